@@ -0,0 +1,396 @@
+import argparse
+import csv
+import math
+import os
+import signal
+import sqlite3
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+# Schedulers under test: name -> loader command ("" = default kernel scheduler;
+# SCHED_EXT tasks fall back to it while no BPF scheduler is attached).
+# "{port}" is replaced with the metrics port, which also enables counter
+# scraping for that scheduler.
+DEFAULT_SCHEDS = {
+    "default": "",
+    "fifo": "./scx_fifo",
+    "mlfq": "./scx_mlfq -p {port}",
+}
+
+# Workload configs: name -> extra load_generator_v2 options (before <seed>)
+DEFAULT_CONFIGS = {
+    "spin": "",
+    "chase-llc": "-k chase -s llc -c 4",
+}
+
+LOADGEN = "./load_generator_v2"
+LOAD_LOG = "load_log.csv"
+METRICS_PORT = 9465
+ATTACH_TIMEOUT_S = 5.0
+
+# metric -> True when higher is better
+METRICS = {
+    "turnaround_mean_ms": False,
+    "turnaround_p95_ms": False,
+    "wait_mean_ms": False,
+    "makespan_ms": False,
+    "work_per_cpus": True,
+    "sched_wait_mean_ms": False,
+    "ctx_switches_mean": False,
+    "migrations_mean": False,
+}
+
+SCHEMA = """
+CREATE TABLE IF NOT EXISTS runs (
+    id INTEGER PRIMARY KEY,
+    started REAL,
+    label TEXT,
+    sched TEXT,
+    config TEXT,
+    seed INTEGER,
+    rc INTEGER
+);
+CREATE TABLE IF NOT EXISTS procs (
+    run_id INTEGER,
+    proc_id INTEGER,
+    arrival_ms REAL,
+    start_ms REAL,
+    end_ms REAL,
+    runtime_ms REAL,
+    cpu_ms REAL,
+    work REAL
+);
+CREATE TABLE IF NOT EXISTS counters (
+    run_id INTEGER,
+    name TEXT,
+    delta REAL
+);
+CREATE TABLE IF NOT EXISTS metrics (
+    run_id INTEGER,
+    name TEXT,
+    value REAL
+);
+"""
+
+
+def parse_kv(items, defaults):
+
+    if not items:
+        return dict(defaults)
+
+    out = {}
+    for item in items:
+        name, sep, value = item.partition("=")
+        if not sep:
+            if name not in defaults:
+                sys.exit(f"unknown entry '{name}', use NAME=VALUE")
+            value = defaults[name]
+        out[name] = value
+    return out
+
+
+def parse_seeds(spec):
+
+    seeds = []
+    for part in spec.split(","):
+        lo, sep, hi = part.partition("-")
+        seeds.extend(range(int(lo), int(hi) + 1) if sep else [int(lo)])
+    return seeds
+
+
+# ---- scheduler control ----
+
+def scrape_counters(port):
+
+    try:
+        with urllib.request.urlopen(f"http://127.0.0.1:{port}/metrics", timeout=2) as r:
+            text = r.read().decode()
+    except OSError:
+        return None
+
+    counters = {}
+    for line in text.splitlines():
+        if line.startswith("#"):
+            continue
+        name, _, value = line.rpartition(" ")
+        if name.endswith("_total") or "_total{" in name:
+            counters[name] = float(value)
+    return counters
+
+
+def start_sched(cmd, port):
+
+    if not cmd:
+        return None
+
+    proc = subprocess.Popen(cmd.format(port=port).split(),
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+
+    # wait until the metrics endpoint answers; loaders without one get a
+    # fixed grace period to attach
+    deadline = time.time() + (ATTACH_TIMEOUT_S if "{port}" in cmd else 1.0)
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            err = proc.stderr.read().decode().strip()
+            sys.exit(f"scheduler '{cmd}' exited with {proc.returncode}: {err}")
+        if "{port}" in cmd and scrape_counters(port) is not None:
+            return proc
+        time.sleep(0.1)
+
+    if "{port}" not in cmd:
+        return proc
+
+    stop_sched(proc)
+    sys.exit(f"scheduler '{cmd}' did not come up in {ATTACH_TIMEOUT_S}s")
+
+
+def stop_sched(proc):
+
+    if proc is None:
+        return
+    proc.send_signal(signal.SIGINT)
+    try:
+        proc.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        proc.wait()
+
+
+# ---- one run ----
+
+def read_load_log(path):
+
+    rows = []
+    with open(path, newline="") as f:
+        for r in csv.DictReader(f):
+            rows.append({
+                "proc_id": int(r["ID"]),
+                "arrival_ms": float(r["Arrival(ms)"]),
+                "start_ms": float(r["Start(ms)"]),
+                "end_ms": float(r["End(ms)"]),
+                "runtime_ms": float(r["Runtime(ms)"]),
+                "cpu_ms": float(r.get("CPU(ms)") or 0),
+                "work": float(r.get("Work") or 0),
+                # empty when load_generator_v2 could not open the counter
+                "sched_wait_ms": float(r.get("SchedWait(ms)") or 0),
+                "ctx_switches": float(r["CtxSwitches"]) if r.get("CtxSwitches") else None,
+                "migrations": float(r["Migrations"]) if r.get("Migrations") else None,
+            })
+    return rows
+
+
+def percentile(values, p):
+
+    values = sorted(values)
+    k = (len(values) - 1) * p
+    lo, hi = math.floor(k), math.ceil(k)
+    return values[lo] + (values[hi] - values[lo]) * (k - lo)
+
+
+def run_metrics(rows):
+
+    turnaround = [r["end_ms"] - r["arrival_ms"] for r in rows]
+    wait = [r["start_ms"] - r["arrival_ms"] for r in rows]
+    cpu_s = sum(r["cpu_ms"] for r in rows) / 1000.0
+
+    metrics = {
+        "turnaround_mean_ms": statistics.mean(turnaround),
+        "turnaround_p95_ms": percentile(turnaround, 0.95),
+        "wait_mean_ms": statistics.mean(wait),
+        "makespan_ms": max(r["end_ms"] for r in rows),
+        "work_per_cpus": sum(r["work"] for r in rows) / cpu_s if cpu_s else 0.0,
+        "sched_wait_mean_ms": statistics.mean(r["sched_wait_ms"] for r in rows),
+    }
+    for name in ("ctx_switches", "migrations"):
+        if all(r[name] is not None for r in rows):
+            metrics[name + "_mean"] = statistics.mean(r[name] for r in rows)
+    return metrics
+
+
+def run_one(db, label, sched, cmd, config, opts, seed, port):
+
+    proc = start_sched(cmd, port)
+    scrape = "{port}" in cmd
+
+    try:
+        before = scrape_counters(port) if scrape else None
+        with tempfile.TemporaryDirectory() as tmp:
+            argv = [os.path.abspath(LOADGEN)] + opts.split() + [str(seed)]
+            started = time.time()
+            rc = subprocess.run(argv, cwd=tmp, stdout=subprocess.DEVNULL).returncode
+            log = os.path.join(tmp, LOAD_LOG)
+            rows = read_load_log(log) if os.path.exists(log) else []
+        after = scrape_counters(port) if scrape else None
+    finally:
+        stop_sched(proc)
+
+    cur = db.execute(
+        "INSERT INTO runs (started, label, sched, config, seed, rc) VALUES (?, ?, ?, ?, ?, ?)",
+        (started, label, sched, config, seed, rc))
+    run_id = cur.lastrowid
+
+    db.executemany(
+        "INSERT INTO procs VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+        [(run_id, r["proc_id"], r["arrival_ms"], r["start_ms"], r["end_ms"],
+          r["runtime_ms"], r["cpu_ms"], r["work"]) for r in rows])
+
+    if before and after:
+        db.executemany(
+            "INSERT INTO counters VALUES (?, ?, ?)",
+            [(run_id, name, after[name] - before.get(name, 0.0)) for name in after])
+
+    if rc == 0 and rows:
+        db.executemany(
+            "INSERT INTO metrics VALUES (?, ?, ?)",
+            [(run_id, name, value) for name, value in run_metrics(rows).items()])
+
+    db.commit()
+    return rc
+
+
+# ---- statistics ----
+
+# two-sided 95% Student t critical values by degrees of freedom
+T95 = {1: 12.706, 2: 4.303, 3: 3.182, 4: 2.776, 5: 2.571, 6: 2.447, 7: 2.365,
+       8: 2.306, 9: 2.262, 10: 2.228, 12: 2.179, 15: 2.131, 20: 2.086,
+       25: 2.060, 30: 2.042, 60: 2.000}
+
+
+def t95(df):
+
+    if df < 1:
+        return float("inf")
+    for k in sorted(T95):
+        if df <= k:
+            return T95[k]
+    return 1.960
+
+
+def mean_ci(values):
+
+    m = statistics.mean(values)
+    if len(values) < 2:
+        return m, float("inf")
+    return m, t95(len(values) - 1) * statistics.stdev(values) / math.sqrt(len(values))
+
+
+def welch_ci(a, b):
+    """95% CI half-width of mean(b) - mean(a) (Welch, unequal variances)"""
+
+    if len(a) < 2 or len(b) < 2:
+        return float("inf")
+    va = statistics.variance(a) / len(a)
+    vb = statistics.variance(b) / len(b)
+    if va + vb == 0:
+        return 0.0
+    df = (va + vb) ** 2 / (va ** 2 / (len(a) - 1) + vb ** 2 / (len(b) - 1))
+    return t95(int(df)) * math.sqrt(va + vb)
+
+
+def load_metric(db, label, sched, config, metric):
+
+    return [v for (v,) in db.execute(
+        "SELECT m.value FROM metrics m JOIN runs r ON r.id = m.run_id "
+        "WHERE r.label = ? AND r.sched = ? AND r.config = ? AND m.name = ?",
+        (label, sched, config, metric))]
+
+
+def compare(db, label, baseline, scheds, configs, thresholds):
+    """Print per-config summaries; returns the list of regressions found"""
+
+    regressions = []
+    for config in configs:
+        print(f"\n=== {config} (baseline: {baseline}) ===")
+        print(f"{'metric':<20} {'sched':<10} {'mean':>12} {'±95%':>10} {'delta':>9}")
+
+        for metric, higher_better in METRICS.items():
+            base = load_metric(db, label, baseline, config, metric)
+            for sched in scheds:
+                vals = load_metric(db, label, sched, config, metric)
+                if not vals:
+                    continue
+                m, ci = mean_ci(vals)
+                delta = ""
+                if sched != baseline and base:
+                    bm = statistics.mean(base)
+                    rel = (m - bm) / bm * 100.0 if bm else 0.0
+                    delta = f"{rel:+.1f}%"
+
+                    # a regression must exceed the threshold and be significant
+                    worse = -rel if higher_better else rel
+                    if metric in thresholds and worse > thresholds[metric] and \
+                            abs(m - bm) > welch_ci(base, vals):
+                        regressions.append((config, sched, metric, rel))
+                        delta += " !"
+                print(f"{metric:<20} {sched:<10} {m:>12.2f} {ci:>10.2f} {delta:>9}")
+
+    return regressions
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Run load_generator_v2 under several schedulers and seeds, "
+                    "store results in SQLite and flag regressions against a baseline")
+    parser.add_argument("-s", "--sched", action="append", metavar="NAME[=CMD]",
+                        help="scheduler under test (default: default, fifo, mlfq); "
+                             "CMD may contain {port} to enable counter scraping")
+    parser.add_argument("-c", "--config", action="append", metavar="NAME[=OPTS]",
+                        help="load_generator_v2 options to run (default: spin, chase-llc)")
+    parser.add_argument("-n", "--seeds", default="1-5", help="seed list, e.g. 1-5,42")
+    parser.add_argument("-b", "--baseline", default="default", help="scheduler to compare against")
+    parser.add_argument("-t", "--threshold", action="append", default=[], metavar="METRIC=PCT",
+                        help=f"fail when METRIC regresses by more than PCT%% ({', '.join(METRICS)})")
+    parser.add_argument("-l", "--label", default=time.strftime("%Y%m%d-%H%M%S"),
+                        help="tag for this batch of runs (default: current time)")
+    parser.add_argument("-d", "--db", default="ab_results.db", help="SQLite results store")
+    parser.add_argument("-p", "--port", type=int, default=METRICS_PORT, help="scheduler metrics port")
+    parser.add_argument("--compare-only", action="store_true",
+                        help="skip the runs and re-evaluate LABEL from the store")
+
+    args = parser.parse_args()
+
+    scheds = parse_kv(args.sched, DEFAULT_SCHEDS)
+    configs = parse_kv(args.config, DEFAULT_CONFIGS)
+    thresholds = {}
+    for t in args.threshold:
+        metric, _, pct = t.partition("=")
+        if metric not in METRICS or not pct:
+            sys.exit(f"bad threshold '{t}', use one of {', '.join(METRICS)}=PCT")
+        thresholds[metric] = float(pct)
+
+    if args.baseline not in scheds:
+        sys.exit(f"baseline '{args.baseline}' is not among the schedulers under test")
+
+    db = sqlite3.connect(args.db)
+    db.executescript(SCHEMA)
+
+    if not args.compare_only:
+        if not os.path.exists(LOADGEN):
+            sys.exit(f"{LOADGEN} not found, run 'make bench' first")
+
+        seeds = parse_seeds(args.seeds)
+        total = len(scheds) * len(configs) * len(seeds)
+        done = 0
+        # interleave schedulers per seed so drift over time hits all of them
+        for config, opts in configs.items():
+            for seed in seeds:
+                for sched, cmd in scheds.items():
+                    done += 1
+                    print(f"[{done}/{total}] {sched} {config} seed={seed}", flush=True)
+                    rc = run_one(db, args.label, sched, cmd, config, opts, seed, args.port)
+                    if rc != 0:
+                        print(f"  load_generator_v2 exited with {rc}, run excluded")
+
+    regressions = compare(db, args.label, args.baseline, scheds, configs, thresholds)
+    db.close()
+
+    print(f"\nResults stored in {args.db} (label {args.label})")
+    if regressions:
+        print("\nREGRESSIONS:")
+        for config, sched, metric, rel in regressions:
+            print(f"  {config}/{sched}: {metric} {rel:+.1f}% vs {args.baseline}")
+        sys.exit(1)
@@ -0,0 +1,66 @@
+import argparse
+import re
+import statistics
+import subprocess
+import sys
+
+from ab_harness import start_sched, stop_sched
+
+# name -> loader command; "" runs the benchmark on the default scheduler
+VARIANTS = {
+    "native": "",
+    "mlfq": "./scx_mlfq",
+    "mlfq -X stats": "./scx_mlfq -X stats",
+    "mlfq -X events": "./scx_mlfq -X events",
+    "mlfq -X acct": "./scx_mlfq -X acct",
+    "mlfq_min": "./scx_mlfq_min",
+    "mlfq_prof": "./scx_mlfq_prof",
+}
+
+BENCH = "./sched_bench"
+
+
+def ns_per_switch(rounds, cpus, native):
+
+    argv = [BENCH] + (["-N"] if native else []) + ["pingpong", str(rounds), cpus]
+    out = subprocess.run(argv, capture_output=True, text=True)
+    m = re.search(r"ns/switch=(\d+)", out.stdout)
+    if out.returncode != 0 or not m:
+        sys.exit(f"{' '.join(argv)} failed: {out.stderr.strip()}")
+    return float(m.group(1))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Per-switch cost of each scx_mlfq build variant (sched_bench pingpong)")
+    parser.add_argument("-r", "--rounds", type=int, default=200000, help="round trips per run")
+    parser.add_argument("-n", "--repeat", type=int, default=5, help="runs per variant")
+    parser.add_argument("--cpu0", action="store_true",
+                        help="pin both tasks to CPU 0, which scx_mlfq serves from its "
+                             "per-CPU DSQs instead of the shared ones")
+    parser.add_argument("variants", nargs="*", help=f"subset of: {', '.join(VARIANTS)}")
+
+    args = parser.parse_args()
+    names = args.variants or list(VARIANTS)
+    cpus = "0" if args.cpu0 else "any"
+
+    results = {}
+    for name in names:
+        if name not in VARIANTS:
+            sys.exit(f"unknown variant '{name}'")
+        cmd = VARIANTS[name]
+        proc = start_sched(cmd, 0)
+        try:
+            runs = [ns_per_switch(args.rounds, cpus, not cmd) for _ in range(args.repeat)]
+        finally:
+            stop_sched(proc)
+        results[name] = runs
+        print(f"{name:<16} median {statistics.median(runs):7.0f} ns/switch "
+              f"(min {min(runs):.0f}, max {max(runs):.0f})", flush=True)
+
+    ref = "mlfq_min" if "mlfq_min" in results else None
+    if ref:
+        base = statistics.median(results[ref])
+        print(f"\nrelative to {ref}:")
+        for name, runs in results.items():
+            print(f"  {name:<16} {statistics.median(runs) - base:+7.0f} ns/switch")
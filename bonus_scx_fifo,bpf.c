@@ -19,6 +19,42 @@ struct {
 	__type(value, struct task_stats);
 } proc_stats SEC(".maps");
 
+/*
+ * set by the loader (-g): keep per-tgid and per-comm totals instead of
+ * proc_stats, so memory and work scale with applications, not threads.
+ * The enqueue time then rides in p->scx.dsq_vtime (unused by a FIFO) and
+ * the run start in run_start, the running task's CPU slot.
+ */
+const volatile bool aggregate;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, u64);
+} run_start SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, AGG_ENTRIES);
+	__type(key, __u32);
+	__type(value, struct agg_stats);
+} tgid_stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, AGG_ENTRIES);
+	__type(key, struct comm_key);
+	__type(value, struct agg_stats);
+} comm_stats SEC(".maps");
+
+/* FIFO_PROFILE builds time every callback, see sched_prof.bpf.h */
+#ifdef FIFO_PROFILE
+#include "sched_prof.bpf.h"
+#else
+#define PROF_SCOPE(id)
+#endif
+
 static __always_inline void stat_inc(u32 idx)
 {
 	u64 *cnt = bpf_map_lookup_elem(&stats, &idx);
@@ -26,9 +62,44 @@ static __always_inline void stat_inc(u32 idx)
 		(*cnt)++;
 }
 
+static __always_inline struct agg_stats *agg_lookup(void *map, const void *key)
+{
+	struct agg_stats zero = {}, *a;
+
+	a = bpf_map_lookup_elem(map, key);
+	if (a)
+		return a;
+	bpf_map_update_elem(map, key, &zero, BPF_NOEXIST);
+	return bpf_map_lookup_elem(map, key);
+}
+
+/* add to this CPU's copy of the task's tgid and comm totals */
+static __always_inline void agg_add(struct task_struct *p, u64 run, u64 wait, u64 switches)
+{
+	u32 tgid = p->tgid;
+	struct comm_key ck = {};
+	struct agg_stats *a;
+
+	a = agg_lookup(&tgid_stats, &tgid);
+	if (a) {
+		a->runtime_ns += run;
+		a->wait_ns += wait;
+		a->nr_switches += switches;
+	}
+
+	bpf_probe_read_kernel_str(ck.comm, sizeof(ck.comm), p->comm);
+	a = agg_lookup(&comm_stats, &ck);
+	if (a) {
+		a->runtime_ns += run;
+		a->wait_ns += wait;
+		a->nr_switches += switches;
+	}
+}
+
 
 s32 BPF_STRUCT_OPS(fifo_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
 {
+	PROF_SCOPE(PROF_SELECT_CPU);
 	bool is_idle = false;
 	s32 cpu;
 
@@ -44,12 +115,18 @@ s32 BPF_STRUCT_OPS(fifo_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wak
 
 void BPF_STRUCT_OPS(fifo_enqueue, struct task_struct *p, u64 enq_flags)
 {
+	PROF_SCOPE(PROF_ENQUEUE);
 	stat_inc(1);
 
 	u32 pid = p->pid;
 	struct task_stats *s;
 	u64 now = bpf_ktime_get_ns();
 
+	if (aggregate) {
+		p->scx.dsq_vtime = now;
+		goto dispatch;
+	}
+
 	s = bpf_map_lookup_elem(&proc_stats, &pid);
 	if (!s) {
 		struct task_stats new_stat = {};
@@ -58,19 +135,32 @@ void BPF_STRUCT_OPS(fifo_enqueue, struct task_struct *p, u64 enq_flags)
 	}
 	/* -------------------------------------- */
 
+dispatch:
 	scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_INF, enq_flags);
 }
 
 void BPF_STRUCT_OPS(fifo_dispatch, s32 cpu, struct task_struct *prev)
 {
+	PROF_SCOPE(PROF_DISPATCH);
 	scx_bpf_consume(SCX_DSQ_GLOBAL);
 }
 
 void BPF_STRUCT_OPS(fifo_running, struct task_struct *p)
 {
-	u32 pid = p->pid;
+	PROF_SCOPE(PROF_RUNNING);
+	u32 pid = p->pid, zero = 0;
 	struct task_stats *s;
 	u64 now = bpf_ktime_get_ns();
+	u64 *start;
+
+	if (aggregate) {
+		start = bpf_map_lookup_elem(&run_start, &zero);
+		if (start)
+			*start = now;
+		agg_add(p, 0, p->scx.dsq_vtime ? now - p->scx.dsq_vtime : 0, 1);
+		p->scx.dsq_vtime = 0;
+		return;
+	}
 
 	s = bpf_map_lookup_elem(&proc_stats, &pid);
 	if (s) {
@@ -85,9 +175,20 @@ void BPF_STRUCT_OPS(fifo_running, struct task_struct *p)
 
 void BPF_STRUCT_OPS(fifo_stopping, struct task_struct *p, bool runnable)
 {
-	u32 pid = p->pid;
+	PROF_SCOPE(PROF_STOPPING);
+	u32 pid = p->pid, zero = 0;
 	struct task_stats *s;
 	u64 now = bpf_ktime_get_ns();
+	u64 *start;
+
+	if (aggregate) {
+		start = bpf_map_lookup_elem(&run_start, &zero);
+		if (start && *start) {
+			agg_add(p, now - *start, 0, 0);
+			*start = 0;
+		}
+		return;
+	}
 
 	s = bpf_map_lookup_elem(&proc_stats, &pid);
 	if (s && s->last_run_ts > 0) {
@@ -6,14 +6,35 @@
 #include <stdarg.h>
 #include <libgen.h>
 #include <time.h>
+#include <string.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <scx/common.h>
 #include "scx_fifo.h"         
 #include "scx_fifo.bpf.skel.h"
+#include "metrics_http.h"
+#include "sched_prof.h"
 
 static bool verbose;
+static bool aggregate;
 static volatile int exit_req;
+static unsigned short metrics_port;
+
+#ifdef FIFO_PROFILE
+/* Callback cost report interval of the profiling build (scx_fifo_bonus_prof) */
+#define PROF_REPORT_MS 1000
+
+static struct sched_prof prof;
+#endif
+
+/* Per-task aggregates collected while printing the process table */
+struct proc_totals {
+    unsigned long long nr_tasks;
+    unsigned long long nr_waiting;
+    unsigned long long runtime_ns;
+    unsigned long long wait_ns;
+    unsigned long long switches;
+};
 
 static int libbpf_print_fn(enum libbpf_print_level level,
 			   const char *format, va_list args)
@@ -49,7 +70,7 @@ static void read_stats(struct scx_fifo *skel, __u64 stats_out[2])
 	}
 }
 
-static void print_process_details(struct scx_fifo *skel)
+static void print_process_details(struct scx_fifo *skel, struct proc_totals *tot)
 {
     int map_fd = bpf_map__fd(skel->maps.proc_stats);
     __u32 key, next_key;
@@ -64,6 +85,8 @@ static void print_process_details(struct scx_fifo *skel)
 
     __u32 *cur_key = NULL; 
 
+    memset(tot, 0, sizeof(*tot));
+
     while (bpf_map_get_next_key(map_fd, cur_key, &next_key) == 0) {
         if (bpf_map_lookup_elem(map_fd, &next_key, &val) == 0) {
             double wait_ms = 0.0;
@@ -74,6 +97,14 @@ static void print_process_details(struct scx_fifo *skel)
             }
 
             if (val.enqueue_time > 0) {
+                tot->nr_tasks++;
+                tot->runtime_ns += val.total_runtime;
+                tot->switches += val.nr_switches;
+                if (val.first_run_time == 0)
+                    tot->nr_waiting++;
+                else if (val.first_run_time > val.enqueue_time)
+                    tot->wait_ns += val.first_run_time - val.enqueue_time;
+
                  // (wait)
                 if (val.first_run_time == 0) {
                      printf("%-8u %-12s %-15llu %-12.2f\n", 
@@ -89,23 +120,201 @@ static void print_process_details(struct scx_fifo *skel)
     printf("----------------------------------------------------\n");
 }
 
+/* One row of an aggregate table, summed over CPUs */
+struct agg_row {
+    char name[24];
+    struct agg_stats s;
+};
+
+struct agg_table {
+    struct agg_row rows[AGG_ENTRIES];
+    unsigned int nr;
+};
+
+/* -g: the per-tgid and per-comm totals of the last round */
+static struct agg_table agg_tgid, agg_comm;
+
+static int cmp_agg_row(const void *a, const void *b)
+{
+    const struct agg_row *x = a, *y = b;
+
+    return x->s.runtime_ns < y->s.runtime_ns ? 1 : x->s.runtime_ns > y->s.runtime_ns ? -1 : 0;
+}
+
+/*
+ * Sum the per-tgid or per-comm totals (-g) into @t, busiest first. One
+ * lookup per application, however many threads it has.
+ */
+static void read_agg(int map_fd, int by_comm, struct agg_table *t)
+{
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct agg_stats vals[nr_cpus];
+    union {
+        __u32 tgid;
+        struct comm_key comm;
+    } key, *cur_key = NULL;
+    struct agg_row *r;
+
+    t->nr = 0;
+    while (t->nr < AGG_ENTRIES && bpf_map_get_next_key(map_fd, cur_key, &key) == 0) {
+        cur_key = &key;
+        if (bpf_map_lookup_elem(map_fd, &key, vals) != 0)
+            continue;
+
+        r = &t->rows[t->nr++];
+        memset(r, 0, sizeof(*r));
+        if (by_comm)
+            snprintf(r->name, sizeof(r->name), "%.16s", key.comm.comm);
+        else
+            snprintf(r->name, sizeof(r->name), "%u", key.tgid);
+        for (int cpu = 0; cpu < nr_cpus; cpu++) {
+            r->s.runtime_ns += vals[cpu].runtime_ns;
+            r->s.wait_ns += vals[cpu].wait_ns;
+            r->s.nr_switches += vals[cpu].nr_switches;
+        }
+    }
+
+    qsort(t->rows, t->nr, sizeof(t->rows[0]), cmp_agg_row);
+}
+
+static void print_agg_details(const struct agg_table *t, int by_comm)
+{
+    unsigned int i;
+
+    printf("\n");
+    printf("%-16s %-12s %-15s %-12s\n", by_comm ? "COMM" : "TGID",
+           "Wait(ms)", "Ctx Switches", "Runtime(ms)");
+    for (i = 0; i < t->nr; i++)
+        printf("%-16s %-12.2f %-15llu %-12.2f\n", t->rows[i].name,
+               t->rows[i].s.wait_ns / 1000000.0, t->rows[i].s.nr_switches,
+               t->rows[i].s.runtime_ns / 1000000.0);
+    printf("----------------------------------------------------\n");
+}
+
+/* scx_fifo_{tgid,comm}_{runtime_ns,wait_ns,switches}, one series per row */
+static void render_agg_metrics(struct metrics_buf *mb, const struct agg_table *t,
+                               const char *key)
+{
+    static const char *const fields[3] = { "runtime_ns", "wait_ns", "switches" };
+    static const char *const helps[3] = {
+        "Time on CPU", "Time queued before running", "Times switched in",
+    };
+    char name[64], help[96], label[64];
+    unsigned int f, i;
+
+    for (f = 0; f < 3; f++) {
+        snprintf(name, sizeof(name), "scx_fifo_%s_%s", key, fields[f]);
+        snprintf(help, sizeof(help), "%s, summed per %s from %s_stats",
+                 helps[f], key, key);
+        metrics_family(mb, name, "counter", help);
+        for (i = 0; i < t->nr; i++) {
+            const struct agg_stats *a = &t->rows[i].s;
+            const unsigned long long v[3] = { a->runtime_ns, a->wait_ns, a->nr_switches };
+
+            metrics_label(label, sizeof(label), key, t->rows[i].name);
+            metrics_counter(mb, name, label, v[f]);
+        }
+    }
+}
+
+static void render_metrics(const __u64 st[2], const struct proc_totals *tot,
+                           struct metrics_buf *mb)
+{
+    metrics_buf_reset(mb);
+    metrics_family(mb, "scx_fifo_local_fastpath", "counter",
+                   "Wakeups dispatched straight to an idle CPU's local DSQ");
+    metrics_counter(mb, "scx_fifo_local_fastpath", NULL, st[0]);
+    metrics_family(mb, "scx_fifo_global_enqueue", "counter",
+                   "Tasks enqueued on SCX_DSQ_GLOBAL");
+    metrics_counter(mb, "scx_fifo_global_enqueue", NULL, st[1]);
+
+    /* -g: proc_stats does not exist, export the application totals instead */
+    if (aggregate) {
+        metrics_family(mb, "scx_fifo_processes", "gauge", "Processes in tgid_stats");
+        metrics_gauge(mb, "scx_fifo_processes", NULL, agg_tgid.nr);
+        metrics_family(mb, "scx_fifo_comms", "gauge", "Comms in comm_stats");
+        metrics_gauge(mb, "scx_fifo_comms", NULL, agg_comm.nr);
+        render_agg_metrics(mb, &agg_tgid, "tgid");
+        render_agg_metrics(mb, &agg_comm, "comm");
+#ifdef FIFO_PROFILE
+        sched_prof_metrics(&prof, mb, "scx_fifo");
+#endif
+        metrics_finish(mb);
+        return;
+    }
+
+    metrics_family(mb, "scx_fifo_tasks", "gauge", "Tasks tracked in proc_stats");
+    metrics_gauge(mb, "scx_fifo_tasks", NULL, tot->nr_tasks);
+    metrics_family(mb, "scx_fifo_tasks_waiting", "gauge",
+                   "Tracked tasks that have not run yet");
+    metrics_gauge(mb, "scx_fifo_tasks_waiting", NULL, tot->nr_waiting);
+    metrics_family(mb, "scx_fifo_task_runtime_seconds", "gauge",
+                   "Summed runtime of tracked tasks");
+    metrics_gauge(mb, "scx_fifo_task_runtime_seconds", NULL, tot->runtime_ns / 1e9);
+    metrics_family(mb, "scx_fifo_task_first_wait_seconds", "gauge",
+                   "Summed enqueue-to-first-run wait of tracked tasks");
+    metrics_gauge(mb, "scx_fifo_task_first_wait_seconds", NULL, tot->wait_ns / 1e9);
+    metrics_family(mb, "scx_fifo_task_switches", "gauge",
+                   "Summed context switches of tracked tasks");
+    metrics_gauge(mb, "scx_fifo_task_switches", NULL, tot->switches);
+#ifdef FIFO_PROFILE
+    sched_prof_metrics(&prof, mb, "scx_fifo");
+#endif
+    metrics_finish(mb);
+}
+
 int main(int argc, char **argv)
 {
 	struct scx_fifo *skel;
 	struct bpf_link *link;
-	int ecode;
+	struct metrics_server *msrv = NULL;
+	struct metrics_buf mb = {};
+	struct proc_totals tot = {};
+	int ecode, opt;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
 	signal(SIGTERM, sigint_handler);
 
+	while ((opt = getopt(argc, argv, "p:gvh")) != -1) {
+		switch (opt) {
+		case 'p':
+			metrics_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			aggregate = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-g] [-v]\n"
+				"  -p  serve OpenMetrics on 127.0.0.1:port/metrics\n"
+				"  -g  keep per-process and per-comm totals instead of per-thread rows\n",
+				basename(argv[0]));
+			return opt != 'h';
+		}
+	}
+
+	if (metrics_port)
+		msrv = metrics_server_start(metrics_port);
+
 restart:
 	skel = SCX_OPS_OPEN(fifo_ops, scx_fifo);
+	skel->rodata->aggregate = aggregate;
+	/* only the maps of the chosen accounting mode are used, and created */
+	bpf_map__set_autocreate(skel->maps.proc_stats, !aggregate);
+	bpf_map__set_autocreate(skel->maps.run_start, aggregate);
+	bpf_map__set_autocreate(skel->maps.tgid_stats, aggregate);
+	bpf_map__set_autocreate(skel->maps.comm_stats, aggregate);
 
 	SCX_OPS_LOAD(skel, fifo_ops, scx_fifo, uei);
 	link = SCX_OPS_ATTACH(skel, fifo_ops, scx_fifo);
     
     printf("Scheduler Loaded. Showing Stats... (Ctrl+C to stop)\n");
+#ifdef FIFO_PROFILE
+	sched_prof_reset(&prof, bpf_map__fd(skel->maps.prof));
+#endif
 
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
 		__u64 st[2];
@@ -118,9 +327,25 @@ restart:
 		       (unsigned long long)st[0],
 		       (unsigned long long)st[1]);
 
-        print_process_details(skel);
+        if (aggregate) {
+            read_agg(bpf_map__fd(skel->maps.tgid_stats), 0, &agg_tgid);
+            read_agg(bpf_map__fd(skel->maps.comm_stats), 1, &agg_comm);
+            print_agg_details(&agg_tgid, 0);
+            print_agg_details(&agg_comm, 1);
+        } else {
+            print_process_details(skel, &tot);
+        }
+#ifdef FIFO_PROFILE
+		/* the screen is redrawn every second, so report every round */
+		sched_prof_poll(&prof, 0);
+#endif
 
 		fflush(stdout);
+
+		if (msrv) {
+			render_metrics(st, &tot, &mb);
+			metrics_server_publish(msrv, &mb);
+		}
 		sleep(1);
 	}
 
@@ -131,5 +356,7 @@ restart:
 	if (ecode == SCX_ECODE_ACT_RESTART)
 		goto restart;
 
+	metrics_server_stop(msrv);
+	metrics_buf_free(&mb);
 	return 0;
 }
@@ -10,4 +10,20 @@ struct task_stats {
     unsigned long long last_run_ts;     
 };
 
+/*
+ * Optional per-application totals (-g), in per-CPU hashes keyed by tgid
+ * and by comm. The loader sums the per-CPU copies.
+ */
+#define AGG_ENTRIES 4096
+
+struct agg_stats {
+    unsigned long long runtime_ns;
+    unsigned long long wait_ns;
+    unsigned long long nr_switches;
+};
+
+struct comm_key {
+    char comm[16];
+};
+
 #endif /* __SCX_FIFO_H */
@@ -8,7 +8,17 @@ import os
 #output
 LOG_FILE = "scheduler_log.csv"
 
-def cpu_burner(proc_id, duration_ms, results_queue):
+# not exported by the os module
+SCHED_EXT = 7
+
+def cpu_burner(proc_id, duration_ms, results_queue, native):
+
+    # run under the BPF scheduler like load_generator_v2's children do
+    if not native:
+        try:
+            os.sched_setscheduler(0, SCHED_EXT, os.sched_param(0))
+        except OSError as e:
+            sys.exit(f"sched_setscheduler(SCHED_EXT) failed: {e.strerror}")
 
     start_time = time.time()
     
@@ -23,7 +33,7 @@ def cpu_burner(proc_id, duration_ms, results_queue):
     # format: ID, StartTime, EndTime, DurationRequested
     results_queue.put((proc_id, start_time, end_time, duration_ms))
 
-def run_workload(seed, num_procs, max_duration, max_delay):
+def run_workload(seed, num_procs, max_duration, max_delay, native):
 
     random.seed(seed)
     
@@ -63,7 +73,7 @@ def run_workload(seed, num_procs, max_duration, max_delay):
         # create and run the process
         p = multiprocessing.Process(
             target=cpu_burner, 
-            args=(task['id'], task['duration'], results_queue)
+            args=(task['id'], task['duration'], results_queue, native)
         )
         p.start()
         active_procs.append(p)
@@ -94,7 +104,9 @@ if __name__ == "__main__":
     parser.add_argument("--procs", type=int, default=5, help="Number of processes")
     parser.add_argument("--duration", type=int, default=2000, help="Max duration (ms)")
     parser.add_argument("--delay", type=int, default=3000, help="Max arrival delay (ms)")
+    parser.add_argument("--native", action="store_true",
+                        help="Keep workers on the default scheduler instead of SCHED_EXT")
     
     args = parser.parse_args()
     
-    run_workload(args.seed, args.procs, args.duration, args.delay)
+    run_workload(args.seed, args.procs, args.duration, args.delay, args.native)
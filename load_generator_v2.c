@@ -10,6 +10,11 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #define NS_PER_MS 1000000LL
 
@@ -23,6 +28,9 @@
 
 #define LOG_FILE          "load_log.csv"
 
+#define CACHE_LINE        64
+#define MAX_THREADS       64
+
 /* ---- sched-ext ---- */
 #ifndef SCHED_EXT
 #define SCHED_EXT 7
@@ -35,6 +43,75 @@ typedef struct {
     pid_t pid;
 } process_spec;
 
+/* ---- Workload kinds ---- */
+enum work_kind {
+    WORK_SPIN,      /* empty loop, no memory footprint */
+    WORK_CHASE,     /* dependent loads over a random cyclic list */
+    WORK_STREAM,    /* sequential reads over the working set */
+};
+
+static const char *const work_kind_names[] = {
+    [WORK_SPIN]   = "spin",
+    [WORK_CHASE]  = "chase",
+    [WORK_STREAM] = "stream",
+};
+
+/* One cache line per list node so every hop touches a new line */
+typedef struct chase_node {
+    struct chase_node *next;
+    char pad[CACHE_LINE - sizeof(struct chase_node *)];
+} chase_node;
+
+typedef struct {
+    enum work_kind kind;
+    size_t   wss;           /* working set in bytes */
+    int      nthreads;      /* threads per process sharing the working set */
+    int      ncpus;         /* processes are pinned to CPUs [0, ncpus) */
+} work_config;
+
+static work_config cfg = { .kind = WORK_SPIN, .nthreads = 1, .ncpus = 1 };
+
+/* Per-process working set, shared by all of its threads */
+static void  *ws_buf;
+static size_t ws_nodes;
+
+/*
+ * ---- Kernel software counters ----
+ * Each worker thread opens its own, not inherited, and reads them itself
+ * before it returns: an inherited counter only folds a child's counts into
+ * the parent's once the child is fully torn down, which can still be
+ * pending after pthread_join. Software events need no PMU; an event the
+ * kernel refuses (perf_event_paranoid) reads as -1 and is written as an
+ * empty CSV field.
+ */
+enum sw_counter {
+    SW_CTX_SWITCHES,
+    SW_MIGRATIONS,
+    SW_PAGE_FAULTS,
+    SW_TASK_CLOCK,          /* ns */
+    SW_NR,
+};
+
+static const unsigned long long sw_configs[SW_NR] = {
+    [SW_CTX_SWITCHES] = PERF_COUNT_SW_CONTEXT_SWITCHES,
+    [SW_MIGRATIONS]   = PERF_COUNT_SW_CPU_MIGRATIONS,
+    [SW_PAGE_FAULTS]  = PERF_COUNT_SW_PAGE_FAULTS,
+    [SW_TASK_CLOCK]   = PERF_COUNT_SW_TASK_CLOCK,
+};
+
+typedef struct {
+    long long sw[SW_NR];    /* -1: counter unavailable */
+    long long run_ns;       /* on-CPU time, from schedstat */
+    long long wait_ns;      /* runnable but waiting, from schedstat */
+} task_counters;
+
+typedef struct {
+    int       idx;
+    long      runtime_ms;
+    long long work;         /* hops, bytes or spin iterations */
+    task_counters tc;       /* this thread's counters over the workload */
+} thread_arg;
+
 /* ---- Time helpers ---- */
 static inline long long now_mono_ns(void)
 {
@@ -50,26 +127,267 @@ static inline long long now_cpu_ns(void)
     return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+static inline long long now_proc_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 /* ---- CPU workload ---- */
-static void cpu_spin_cpu_time(long runtime_ms)
+static long long cpu_spin_cpu_time(long runtime_ms)
 {
     long long start = now_cpu_ns();
     long long dur   = runtime_ms * NS_PER_MS;
+    long long iters = 0;
 
-    while ((now_cpu_ns() - start) < dur)
+    while ((now_cpu_ns() - start) < dur) {
         asm volatile("" ::: "memory");
+        iters++;
+    }
+    return iters;
+}
+
+/* Clock reads are far costlier than a hop; check it every CHECK_EVERY units */
+#define CHECK_EVERY 1024
+
+static long long chase_cpu_time(long runtime_ms, size_t start_node)
+{
+    long long start = now_cpu_ns();
+    long long dur   = runtime_ms * NS_PER_MS;
+    long long hops  = 0;
+    chase_node *n   = (chase_node *)ws_buf + start_node % ws_nodes;
+
+    while ((now_cpu_ns() - start) < dur) {
+        for (int i = 0; i < CHECK_EVERY; i++)
+            n = n->next;
+        hops += CHECK_EVERY;
+    }
+    /* keep the chain live */
+    asm volatile("" :: "r"(n) : "memory");
+    return hops;
+}
+
+static long long stream_cpu_time(long runtime_ms)
+{
+    long long start = now_cpu_ns();
+    long long dur   = runtime_ms * NS_PER_MS;
+    long long bytes = 0;
+    const uint64_t *w = ws_buf;
+    size_t nwords = cfg.wss / sizeof(uint64_t);
+    size_t pos = 0;
+    uint64_t sum = 0;
+
+    while ((now_cpu_ns() - start) < dur) {
+        for (int i = 0; i < CHECK_EVERY; i++) {
+            sum += w[pos];
+            if (++pos == nwords)
+                pos = 0;
+        }
+        bytes += CHECK_EVERY * sizeof(uint64_t);
+    }
+    asm volatile("" :: "r"(sum) : "memory");
+    return bytes;
+}
+
+/* run and wait ns of the calling thread; both stay 0 without schedstats */
+static void read_schedstat(long long *run_ns, long long *wait_ns)
+{
+    FILE *f = fopen("/proc/thread-self/schedstat", "r");
+
+    *run_ns = *wait_ns = 0;
+    if (!f)
+        return;
+    if (fscanf(f, "%lld %lld", run_ns, wait_ns) != 2)
+        *run_ns = *wait_ns = 0;
+    fclose(f);
+}
+
+/* counters of the calling thread, opened disabled */
+static void open_sw_counters(int fds[SW_NR])
+{
+    for (int i = 0; i < SW_NR; i++) {
+        struct perf_event_attr attr = {
+            .type           = PERF_TYPE_SOFTWARE,
+            .size           = sizeof(attr),
+            .config         = sw_configs[i],
+            .disabled       = 1,
+        };
+
+        fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+}
+
+static void enable_sw_counters(const int fds[SW_NR], int on)
+{
+    for (int i = 0; i < SW_NR; i++)
+        if (fds[i] >= 0)
+            ioctl(fds[i], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/* fills tc->sw from @fds and closes them */
+static void read_sw_counters(int fds[SW_NR], task_counters *tc)
+{
+    for (int i = 0; i < SW_NR; i++) {
+        uint64_t v;
+
+        tc->sw[i] = -1;
+        if (fds[i] >= 0) {
+            if (read(fds[i], &v, sizeof(v)) == sizeof(v))
+                tc->sw[i] = (long long)v;
+            close(fds[i]);
+        }
+    }
 }
 
-/* ---- pin current process to CPU 0 ---- */
-static void pin_to_cpu0_or_die(void)
+static void *worker_thread(void *data)
+{
+    thread_arg *a = data;
+    int fds[SW_NR];
+    long long run0, wait0;
+
+    open_sw_counters(fds);
+    read_schedstat(&run0, &wait0);
+    enable_sw_counters(fds, 1);
+
+    switch (cfg.kind) {
+    case WORK_CHASE:
+        /* spread threads around the ring so they do not walk in lockstep */
+        a->work = chase_cpu_time(a->runtime_ms,
+                                 ws_nodes / cfg.nthreads * a->idx);
+        break;
+    case WORK_STREAM:
+        a->work = stream_cpu_time(a->runtime_ms);
+        break;
+    default:
+        a->work = cpu_spin_cpu_time(a->runtime_ms);
+        break;
+    }
+
+    enable_sw_counters(fds, 0);
+    read_schedstat(&a->tc.run_ns, &a->tc.wait_ns);
+    a->tc.run_ns  -= run0;
+    a->tc.wait_ns -= wait0;
+    read_sw_counters(fds, &a->tc);
+    return NULL;
+}
+
+/*
+ * Run the configured workload on nthreads threads; returns total work and
+ * fills @tc with its threads' counters summed over the run
+ */
+static long long run_workload(long runtime_ms, task_counters *tc)
+{
+    pthread_t tids[MAX_THREADS];
+    thread_arg args[MAX_THREADS];
+    long long total = 0;
+
+    for (int t = 0; t < cfg.nthreads; t++) {
+        args[t] = (thread_arg){ .idx = t, .runtime_ms = runtime_ms };
+        if (t && pthread_create(&tids[t], NULL, worker_thread, &args[t]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            _exit(1);
+        }
+    }
+
+    worker_thread(&args[0]);
+    for (int t = 1; t < cfg.nthreads; t++)
+        pthread_join(tids[t], NULL);
+
+    *tc = (task_counters){ 0 };
+    for (int t = 0; t < cfg.nthreads; t++) {
+        total += args[t].work;
+        tc->run_ns  += args[t].tc.run_ns;
+        tc->wait_ns += args[t].tc.wait_ns;
+        /* a counter any thread could not open is unavailable for all */
+        for (int i = 0; i < SW_NR; i++)
+            tc->sw[i] = tc->sw[i] < 0 || args[t].tc.sw[i] < 0 ?
+                        -1 : tc->sw[i] + args[t].tc.sw[i];
+    }
+    return total;
+}
+
+/* ---- Working set setup (before the start barrier, so it is not timed) ---- */
+static void setup_working_set(void)
+{
+    if (cfg.kind == WORK_SPIN)
+        return;
+
+    if (posix_memalign(&ws_buf, CACHE_LINE, cfg.wss) != 0) {
+        fprintf(stderr, "cannot allocate %zu byte working set\n", cfg.wss);
+        _exit(1);
+    }
+
+    if (cfg.kind == WORK_STREAM) {
+        memset(ws_buf, 1, cfg.wss);
+        return;
+    }
+
+    /* Sattolo's algorithm: a single random cycle through every node */
+    chase_node *nodes = ws_buf;
+    size_t *order = malloc(ws_nodes * sizeof(*order));
+    if (!order)
+        _exit(1);
+
+    for (size_t i = 0; i < ws_nodes; i++)
+        order[i] = i;
+    for (size_t i = ws_nodes - 1; i > 0; i--) {
+        size_t j = (size_t)rand() % i;
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (size_t i = 0; i < ws_nodes; i++)
+        nodes[order[i]].next = &nodes[order[(i + 1) % ws_nodes]];
+
+    free(order);
+}
+
+/* ---- Working set size presets, from the cache sizes the libc reports ---- */
+static long cache_size(int name, long fallback)
+{
+    long sz = sysconf(name);
+    return sz > 0 ? sz : fallback;
+}
+
+static size_t parse_wss(const char *arg)
+{
+    long l1  = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32L << 10);
+    long l2  = cache_size(_SC_LEVEL2_CACHE_SIZE, 1L << 20);
+    long llc = cache_size(_SC_LEVEL3_CACHE_SIZE, l2);
+    char *end;
+    size_t sz;
+
+    /* presets use half of the level so the set stays resident in it */
+    if (!strcmp(arg, "l1"))
+        return l1 / 2;
+    if (!strcmp(arg, "l2"))
+        return l2 / 2;
+    if (!strcmp(arg, "llc"))
+        return llc / 2;
+    if (!strcmp(arg, "dram"))
+        return (size_t)llc * 8 > (256UL << 20) ? (size_t)llc * 8 : 256UL << 20;
+
+    sz = strtoull(arg, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': sz <<= 10; break;
+    case 'm': case 'M': sz <<= 20; break;
+    case 'g': case 'G': sz <<= 30; break;
+    }
+    return sz;
+}
+
+/* ---- pin current process to CPUs [0, ncpus) ---- */
+static void pin_to_cpus_or_die(int ncpus)
 {
     cpu_set_t set;
     CPU_ZERO(&set);
-    CPU_SET(0, &set);
+    for (int cpu = 0; cpu < ncpus; cpu++)
+        CPU_SET(cpu, &set);
 
     if (sched_setaffinity(0, sizeof(set), &set) != 0) {
-        fprintf(stderr, "sched_setaffinity(CPU0) failed: %s\n",
-                strerror(errno));
+        fprintf(stderr, "sched_setaffinity(CPU0-%d) failed: %s\n",
+                ncpus - 1, strerror(errno));
         exit(1);
     }
 }
@@ -98,9 +416,16 @@ static int cmp_arrival(const void *a, const void *b)
 }
 
 /* ---- CSV append with lock ---- */
+static int fmt_counter(char *buf, size_t len, long long v)
+{
+    return v < 0 ? snprintf(buf, len, ",") : snprintf(buf, len, ",%lld", v);
+}
+
 static void append_csv_line(const char *path,
                             int id, pid_t pid, long arrival_ms,
-                            double start_ms, double end_ms, long runtime_ms)
+                            double start_ms, double end_ms, long runtime_ms,
+                            double cpu_ms, long long work,
+                            const task_counters *tc)
 {
     int fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0644);
     if (fd < 0)
@@ -108,11 +433,23 @@ static void append_csv_line(const char *path,
 
     flock(fd, LOCK_EX);
 
-    char buf[256];
+    char buf[384];
     int len = snprintf(buf, sizeof(buf),
-        "%d,%d,%ld,%.3f,%.3f,%ld\n",
+        "%d,%d,%ld,%.3f,%.3f,%ld,%s,%zu,%d,%.3f,%lld,%.0f",
         id, (int)pid, arrival_ms,
-        start_ms, end_ms, runtime_ms);
+        start_ms, end_ms, runtime_ms,
+        work_kind_names[cfg.kind], cfg.wss, cfg.nthreads,
+        cpu_ms, work, cpu_ms > 0 ? work / (cpu_ms / 1e3) : 0.0);
+
+    for (int i = 0; i < SW_TASK_CLOCK; i++)
+        len += fmt_counter(buf + len, sizeof(buf) - len, tc->sw[i]);
+    if (tc->sw[SW_TASK_CLOCK] < 0)
+        len += snprintf(buf + len, sizeof(buf) - len, ",");
+    else
+        len += snprintf(buf + len, sizeof(buf) - len, ",%.3f",
+                        tc->sw[SW_TASK_CLOCK] / 1e6);
+    len += snprintf(buf + len, sizeof(buf) - len, ",%.3f,%.3f\n",
+                    tc->run_ns / 1e6, tc->wait_ns / 1e6);
 
     write(fd, buf, len);
 
@@ -120,15 +457,70 @@ static void append_csv_line(const char *path,
     close(fd);
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-k spin|chase|stream] [-s l1|l2|llc|dram|bytes[K|M|G]]\n"
+        "          [-t threads] [-c ncpus] <seed>\n"
+        "  -k  workload kind (default spin: no memory footprint)\n"
+        "  -s  working set per process for chase/stream (default l2)\n"
+        "  -t  threads per process sharing its working set (default 1)\n"
+        "  -c  pin to CPUs 0..ncpus-1 instead of CPU0 only\n",
+        prog);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <seed>\n", argv[0]);
+    const char *wss_arg = "l2";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:s:t:c:h")) != -1) {
+        switch (opt) {
+        case 'k':
+            if (!strcmp(optarg, "chase"))
+                cfg.kind = WORK_CHASE;
+            else if (!strcmp(optarg, "stream"))
+                cfg.kind = WORK_STREAM;
+            else if (!strcmp(optarg, "spin"))
+                cfg.kind = WORK_SPIN;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            wss_arg = optarg;
+            break;
+        case 't':
+            cfg.nthreads = atoi(optarg);
+            break;
+        case 'c':
+            cfg.ncpus = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    if (optind != argc - 1 || cfg.nthreads < 1 || cfg.nthreads > MAX_THREADS ||
+        cfg.ncpus < 1 || cfg.ncpus > CPU_SETSIZE) {
+        usage(argv[0]);
         return 1;
     }
 
-    pin_to_cpu0_or_die();
-    srand(atoi(argv[1]));
+    if (cfg.kind != WORK_SPIN) {
+        cfg.wss = parse_wss(wss_arg);
+        ws_nodes = cfg.wss / sizeof(chase_node);
+        if (ws_nodes < 2) {
+            fprintf(stderr, "working set too small: %s\n", wss_arg);
+            return 1;
+        }
+        cfg.wss = ws_nodes * sizeof(chase_node);
+    }
+
+    pin_to_cpus_or_die(cfg.ncpus);
+    srand(atoi(argv[optind]));
 
     int nproc = MIN_PROCESSES +
         rand() % (MAX_PROCESSES - MIN_PROCESSES + 1);
@@ -151,7 +543,10 @@ int main(int argc, char *argv[])
     {
         int fd = open(LOG_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644);
         const char *hdr =
-            "ID,PID,Arrival(ms),Start(ms),End(ms),Runtime(ms)\n";
+            "ID,PID,Arrival(ms),Start(ms),End(ms),Runtime(ms),"
+            "Kind,WSS(B),Threads,CPU(ms),Work,Work/CPUs,"
+            "CtxSwitches,Migrations,PageFaults,TaskClock(ms),"
+            "SchedRun(ms),SchedWait(ms)\n";
         write(fd, hdr, strlen(hdr));
         close(fd);
     }
@@ -172,21 +567,26 @@ int main(int argc, char *argv[])
             exit(1);
 
         if (pid == 0) {
-            pin_to_cpu0_or_die();
+            pin_to_cpus_or_die(cfg.ncpus);
             set_sched_ext_or_die();
+            setup_working_set();
 
             /* Hard barrier: do not run */
             raise(SIGSTOP);
 
+            task_counters tc;
+            long long start_cpu  = now_proc_cpu_ns();
             long long start_wall = now_mono_ns();
-            cpu_spin_cpu_time(procs[i].runtime_ms);
+            long long work = run_workload(procs[i].runtime_ms, &tc);
             long long end_wall   = now_mono_ns();
+            long long end_cpu    = now_proc_cpu_ns();
 
             append_csv_line(LOG_FILE,
                 procs[i].id, getpid(), procs[i].arrival_ms,
                 (start_wall - global_start) / 1e6,
                 (end_wall   - global_start) / 1e6,
-                procs[i].runtime_ms);
+                procs[i].runtime_ms,
+                (end_cpu - start_cpu) / 1e6, work, &tc);
 
             _exit(0);
         }
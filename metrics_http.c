@@ -0,0 +1,303 @@
+/*
+ * metrics_http.c - minimal OpenMetrics exporter shared by the scheduler loaders
+ *
+ * The loader's sampling loop renders a snapshot into a metrics_buf and
+ * publishes it; the listener thread only ever copies the latest published
+ * snapshot out to the client. A scrape therefore never touches BPF maps and
+ * costs the same no matter how many tasks the scheduler is tracking.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics_http.h"
+
+#define POLL_INTERVAL_MS 200
+#define CLIENT_TIMEOUT_MS 1000	/* per read/write, so one stuck client cannot stall us */
+
+struct metrics_server {
+	int fd;
+	volatile int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct metrics_buf snap;	/* guarded by lock */
+	struct metrics_buf scratch;	/* listener-private copy */
+};
+
+static const char empty_snapshot[] = "# EOF\n";
+
+static void buf_reserve(struct metrics_buf *mb, size_t extra)
+{
+	size_t want = mb->len + extra + 1;
+	char *nbuf;
+
+	if (want <= mb->cap)
+		return;
+
+	if (want < 4096)
+		want = 4096;
+	if (want < mb->cap * 2)
+		want = mb->cap * 2;
+
+	nbuf = realloc(mb->buf, want);
+	if (!nbuf)
+		return;
+	mb->buf = nbuf;
+	mb->cap = want;
+}
+
+static void buf_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+
+	buf_reserve(mb, n);
+	if (mb->len + n + 1 > mb->cap)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(mb->buf + mb->len, mb->cap - mb->len, fmt, ap);
+	va_end(ap);
+	mb->len += n;
+}
+
+void metrics_buf_reset(struct metrics_buf *mb)
+{
+	mb->len = 0;
+}
+
+void metrics_buf_free(struct metrics_buf *mb)
+{
+	free(mb->buf);
+	mb->buf = NULL;
+	mb->len = mb->cap = 0;
+}
+
+void metrics_family(struct metrics_buf *mb, const char *name,
+		    const char *type, const char *help)
+{
+	buf_printf(mb, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+void metrics_counter(struct metrics_buf *mb, const char *name,
+		     const char *labels, unsigned long long val)
+{
+	if (labels)
+		buf_printf(mb, "%s_total{%s} %llu\n", name, labels, val);
+	else
+		buf_printf(mb, "%s_total %llu\n", name, val);
+}
+
+void metrics_gauge(struct metrics_buf *mb, const char *name,
+		   const char *labels, double val)
+{
+	if (labels)
+		buf_printf(mb, "%s{%s} %.17g\n", name, labels, val);
+	else
+		buf_printf(mb, "%s %.17g\n", name, val);
+}
+
+size_t metrics_label(char *buf, size_t len, const char *key, const char *val)
+{
+	size_t n;
+	const char *c;
+
+	if (!len)
+		return 0;
+	n = snprintf(buf, len, "%s=\"", key);
+	if (n >= len)	/* key truncated: n is what it would have needed */
+		return len - 1;
+
+	for (c = val; *c && n + 4 < len; c++) {
+		if (*c == '"' || *c == '\\')
+			buf[n++] = '\\';
+		if (*c == '\n') {
+			buf[n++] = '\\';
+			buf[n++] = 'n';
+			continue;
+		}
+		buf[n++] = *c;
+	}
+	n += snprintf(buf + n, len - n, "\"");
+	return n < len ? n : len - 1;
+}
+
+void metrics_finish(struct metrics_buf *mb)
+{
+	buf_printf(mb, "# EOF\n");
+}
+
+void metrics_server_publish(struct metrics_server *srv, struct metrics_buf *mb)
+{
+	struct metrics_buf tmp;
+
+	if (!srv)
+		return;
+
+	pthread_mutex_lock(&srv->lock);
+	tmp = srv->snap;
+	srv->snap = *mb;
+	*mb = tmp;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static void write_all(int fd, const char *p, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		p += n;
+		len -= n;
+	}
+}
+
+static void serve_one(struct metrics_server *srv, int cfd)
+{
+	struct metrics_buf *out = &srv->scratch;
+	const char *body;
+	size_t body_len;
+	char req[1024], hdr[256];
+	ssize_t n;
+	int hlen;
+
+	n = read(cfd, req, sizeof(req) - 1);
+	if (n <= 0)
+		return;
+	req[n] = '\0';
+
+	if (strncmp(req, "GET /metrics", 12) && strncmp(req, "GET / ", 6)) {
+		static const char nf[] =
+			"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		write_all(cfd, nf, sizeof(nf) - 1);
+		return;
+	}
+
+	/* Copy out under the lock so the sampler never waits on a slow client */
+	pthread_mutex_lock(&srv->lock);
+	metrics_buf_reset(out);
+	if (srv->snap.len) {
+		buf_reserve(out, srv->snap.len);
+		if (out->cap > srv->snap.len) {
+			memcpy(out->buf, srv->snap.buf, srv->snap.len);
+			out->len = srv->snap.len;
+		}
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	body = out->len ? out->buf : empty_snapshot;
+	body_len = out->len ? out->len : sizeof(empty_snapshot) - 1;
+
+	hlen = snprintf(hdr, sizeof(hdr),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", body_len);
+	write_all(cfd, hdr, hlen);
+	write_all(cfd, body, body_len);
+}
+
+static void *server_thread(void *arg)
+{
+	struct metrics_server *srv = arg;
+	struct pollfd pfd = { .fd = srv->fd, .events = POLLIN };
+	struct timeval tmo = {
+		.tv_sec = CLIENT_TIMEOUT_MS / 1000,
+		.tv_usec = CLIENT_TIMEOUT_MS % 1000 * 1000,
+	};
+
+	while (!srv->stop) {
+		int cfd;
+
+		if (poll(&pfd, 1, POLL_INTERVAL_MS) <= 0)
+			continue;
+
+		cfd = accept(srv->fd, NULL, NULL);
+		if (cfd < 0)
+			continue;
+
+		setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+		setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+		serve_one(srv, cfd);
+		close(cfd);
+	}
+
+	return NULL;
+}
+
+struct metrics_server *metrics_server_start(unsigned short port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct metrics_server *srv;
+	int one = 1;
+
+	srv = calloc(1, sizeof(*srv));
+	if (!srv)
+		return NULL;
+
+	srv->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (srv->fd < 0) {
+		fprintf(stderr, "metrics: socket failed: %s\n", strerror(errno));
+		goto err_free;
+	}
+
+	setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(srv->fd, 16)) {
+		fprintf(stderr, "metrics: cannot listen on 127.0.0.1:%u: %s\n",
+			port, strerror(errno));
+		goto err_close;
+	}
+
+	pthread_mutex_init(&srv->lock, NULL);
+	if (pthread_create(&srv->thread, NULL, server_thread, srv)) {
+		fprintf(stderr, "metrics: pthread_create failed\n");
+		pthread_mutex_destroy(&srv->lock);
+		goto err_close;
+	}
+
+	return srv;
+
+err_close:
+	close(srv->fd);
+err_free:
+	free(srv);
+	return NULL;
+}
+
+void metrics_server_stop(struct metrics_server *srv)
+{
+	if (!srv)
+		return;
+
+	srv->stop = 1;
+	pthread_join(srv->thread, NULL);
+	close(srv->fd);
+	pthread_mutex_destroy(&srv->lock);
+	metrics_buf_free(&srv->snap);
+	metrics_buf_free(&srv->scratch);
+	free(srv);
+}
@@ -0,0 +1,53 @@
+/* metrics_http.h - minimal OpenMetrics exporter shared by the scheduler loaders */
+#ifndef __METRICS_HTTP_H
+#define __METRICS_HTTP_H
+
+#include <stddef.h>
+
+/* Growable text buffer a snapshot is rendered into */
+struct metrics_buf {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+struct metrics_server;
+
+/*
+ * Start serving GET /metrics on 127.0.0.1:port from a background thread.
+ * Returns NULL (and prints why) if the socket cannot be set up.
+ */
+struct metrics_server *metrics_server_start(unsigned short port);
+void metrics_server_stop(struct metrics_server *srv);
+
+/*
+ * Hand a fully rendered snapshot to the server. The buffers are swapped, so
+ * @mb gets the previous snapshot's storage back and must be reset before
+ * it is reused. Scrapes never wait on anything but this swap.
+ */
+void metrics_server_publish(struct metrics_server *srv, struct metrics_buf *mb);
+
+void metrics_buf_reset(struct metrics_buf *mb);
+void metrics_buf_free(struct metrics_buf *mb);
+
+/* "# TYPE" / "# HELP" lines; @type is "counter" or "gauge" */
+void metrics_family(struct metrics_buf *mb, const char *name,
+		    const char *type, const char *help);
+
+/* One sample; @labels is NULL or e.g. "level=\"hi\"". Counters get "_total". */
+void metrics_counter(struct metrics_buf *mb, const char *name,
+		     const char *labels, unsigned long long val);
+void metrics_gauge(struct metrics_buf *mb, const char *name,
+		   const char *labels, double val);
+
+/*
+ * Render key="value" into @buf with the OpenMetrics label escapes, for the
+ * @labels argument above. @buf is NUL terminated, truncated if it is too
+ * short; returns its length.
+ */
+size_t metrics_label(char *buf, size_t len, const char *key, const char *val);
+
+/* Terminates the exposition with "# EOF" */
+void metrics_finish(struct metrics_buf *mb);
+
+#endif /* __METRICS_HTTP_H */
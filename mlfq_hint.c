@@ -0,0 +1,98 @@
+/*
+ * mlfq_hint.c - client side of scx_mlfq's lock-holder slice extension
+ *
+ * scx_mlfq pins slice_hints, an mmapable array of struct slice_hint. A
+ * thread claims a free slot among the MLFQ_HINT_PROBE it may use by CAS on
+ * its tid, and from then on enters and leaves critical sections with a
+ * plain atomic add on the mmapped slot. BPF finds the slot by the same
+ * probe, so no BPF command is needed past opening the pinned map.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <bpf/bpf.h>
+
+#include "mlfq_hint.h"
+
+__thread struct slice_hint *mlfq_hint_self;
+
+/* Inode number of the initial PID namespace (PROC_PID_INIT_INO) */
+#define PID_NS_INIT_INO	0xEFFFFFFCU
+
+static pthread_once_t hint_once = PTHREAD_ONCE_INIT;
+static struct slice_hint *hints;
+static int init_err;
+
+static void hint_open(void)
+{
+	size_t len = sizeof(struct slice_hint) * MLFQ_HINT_SLOTS;
+	struct stat st;
+	void *map;
+	int fd;
+
+	/* BPF looks hints up by global pid, so gettid() must return that */
+	if (stat("/proc/self/ns/pid", &st) || st.st_ino != PID_NS_INIT_INO) {
+		init_err = -EOPNOTSUPP;
+		return;
+	}
+
+	fd = bpf_obj_get(MLFQ_HINT_PIN_DIR "/" MLFQ_HINT_MAP);
+	if (fd < 0) {
+		init_err = -errno;
+		return;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		init_err = -errno;
+		return;
+	}
+
+	hints = map;
+}
+
+int mlfq_hint_register(void)
+{
+	__u32 tid = syscall(SYS_gettid);
+	__u32 i, idx;
+
+	if (mlfq_hint_self)
+		return 0;
+
+	pthread_once(&hint_once, hint_open);
+	if (!hints)
+		return init_err;
+
+	/* only the slots BPF probes for this tid, see MLFQ_HINT_PROBE */
+	for (i = 0; i < MLFQ_HINT_PROBE; i++) {
+		__u32 free_tid = 0;
+
+		idx = (tid + i) % MLFQ_HINT_SLOTS;
+		/* a slot already holding our tid was left by a dead thread */
+		if (!__atomic_compare_exchange_n(&hints[idx].tid, &free_tid, tid, false,
+						 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) &&
+		    free_tid != tid)
+			continue;
+
+		hints[idx].in_cs = 0;
+		mlfq_hint_self = &hints[idx];
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+void mlfq_hint_unregister(void)
+{
+	if (!mlfq_hint_self)
+		return;
+
+	mlfq_hint_self->in_cs = 0;
+	__atomic_store_n(&mlfq_hint_self->tid, 0, __ATOMIC_RELEASE);
+	mlfq_hint_self = NULL;
+}
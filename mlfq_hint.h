@@ -0,0 +1,53 @@
+/* mlfq_hint.h - lock-holder hints for programs running under scx_mlfq */
+#ifndef __MLFQ_HINT_H
+#define __MLFQ_HINT_H
+
+#include <linux/types.h>
+#include "scx_mlfq.h"
+
+/* This thread's hint, NULL until mlfq_hint_register() succeeds */
+extern __thread struct slice_hint *mlfq_hint_self;
+
+/*
+ * Claim a hint slot for the calling thread. Opens scx_mlfq's pinned hint
+ * map on first use. Returns 0, or a negative errno if the scheduler is not
+ * loaded, the map cannot be opened, or every slot this tid may use is
+ * taken; the enter/exit calls are then no-ops.
+ *
+ * Slots are keyed by the thread's global tid, so hints only work in the
+ * initial PID namespace: inside a container gettid() is namespace-local,
+ * and registration fails with -EOPNOTSUPP. BPF frees the slot of a thread
+ * that exits while on SCHED_EXT; any other thread must unregister itself,
+ * or its slot stays taken until the tid is reused.
+ *
+ * Trust model: no BPF privilege is needed, only read/write access to
+ * MLFQ_HINT_PIN_DIR/MLFQ_HINT_MAP. The pin is root-only (0600) unless the
+ * administrator grants more. Every process with that access is trusted
+ * alike: BPF cannot tell who wrote a slot, so such a process can claim a
+ * slot for, or raise in_cs of, any thread. The most that buys a thread is
+ * one slice extension (scx_mlfq -E) per HI slice, repaid from its next
+ * one, or hint slots that other threads then cannot get.
+ */
+int mlfq_hint_register(void);
+
+/* Give the slot back; exiting threads that skip this are reaped by BPF */
+void mlfq_hint_unregister(void);
+
+/*
+ * Bracket a critical section. Nesting is allowed. While the depth is
+ * non-zero a HI thread whose slice runs out gets one extension (scx_mlfq -E)
+ * instead of being preempted with the lock held.
+ */
+static inline void mlfq_hint_enter(void)
+{
+	if (mlfq_hint_self)
+		__atomic_add_fetch(&mlfq_hint_self->in_cs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void mlfq_hint_exit(void)
+{
+	if (mlfq_hint_self)
+		__atomic_sub_fetch(&mlfq_hint_self->in_cs, 1, __ATOMIC_RELAXED);
+}
+
+#endif /* __MLFQ_HINT_H */
@@ -1,3 +1,5 @@
+import argparse
+
 import pandas as pd
 import matplotlib.pyplot as plt
 import matplotlib.patches as mpatches
@@ -66,5 +68,50 @@ def analyze_fifo(log_file):
     print("\nGantt chart saved to 'fifo_gantt_chart.png'")
     plt.show()
 
+# load_generator_v2 counter columns; empty when the kernel refused the event
+COUNTER_COLS = ['CtxSwitches', 'Migrations', 'PageFaults', 'SchedWait(ms)']
+
+def analyze_counters(log_file):
+    """Attribute load_generator_v2 slowdowns to queueing, switches, migrations and faults"""
+
+    df = pd.read_csv(log_file)
+    missing = [c for c in COUNTER_COLS if c not in df.columns]
+    if missing:
+        print(f"{log_file} has no {', '.join(missing)} columns (older load_generator_v2?)")
+        return
+
+    # slowdown: time from arrival to completion over the requested runtime
+    df['Turnaround(ms)'] = df['End(ms)'] - df['Arrival(ms)']
+    df['Slowdown'] = df['Turnaround(ms)'] / df['Runtime(ms)']
+    df['WaitShare'] = df['SchedWait(ms)'] / (df['End(ms)'] - df['Start(ms)'])
+
+    print("\n--- Per-process counters (slowest first) ---")
+    cols = ['ID', 'Runtime(ms)', 'Turnaround(ms)', 'Slowdown', 'WaitShare'] + COUNTER_COLS[:3]
+    print(df.sort_values(by='Slowdown', ascending=False)[cols].to_string(index=False))
+
+    print("\n--- Correlation with slowdown ---")
+    for col in COUNTER_COLS:
+        if df[col].notna().sum() < 2 or df[col].nunique() < 2:
+            print(f"{col:<14} n/a")
+            continue
+        print(f"{col:<14} {df['Slowdown'].corr(df[col]):+.2f}")
+
+    # schedstat: time on a CPU vs. runnable on a queue, summed over all processes
+    run = df['SchedRun(ms)'].sum()
+    wait = df['SchedWait(ms)'].sum()
+    if run + wait > 0:
+        print(f"\nrunnable-but-waiting share of scheduled time: {wait / (run + wait) * 100:.1f}%")
+    print(f"per process: {df['CtxSwitches'].mean():.1f} switches, "
+          f"{df['Migrations'].mean():.1f} migrations, {df['PageFaults'].mean():.1f} faults (mean)")
+
 if __name__ == "__main__":
-    analyze_fifo("scheduler_log.csv")
\ No newline at end of file
+    parser = argparse.ArgumentParser(description="Analyze scheduler run logs")
+    parser.add_argument("-c", "--counters", metavar="LOAD_LOG",
+                        help="attribute slowdowns in a load_generator_v2 load_log.csv "
+                             "instead of checking the FIFO log")
+    args = parser.parse_args()
+
+    if args.counters:
+        analyze_counters(args.counters)
+    else:
+        analyze_fifo("scheduler_log.csv")
\ No newline at end of file
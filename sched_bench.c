@@ -0,0 +1,920 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * sched_bench - micro-benchmarks for the sched_ext schedulers in this repo.
+ *
+ * Every benchmark thread switches itself to SCHED_EXT (unless -N is given,
+ * which runs the same workload under the default scheduler as a baseline).
+ * With -p <port> the scheduler's metrics endpoint is scraped before and
+ * after the run so scheduler-side rates can be printed next to the result.
+ */
+
+#define NS_PER_SEC 1000000000LL
+
+#define MSG_SIZE 100
+
+/* ---- sched-ext ---- */
+#ifndef SCHED_EXT
+#define SCHED_EXT 7
+#endif
+
+static int use_native;
+static unsigned short metrics_port;
+static const char *metrics_prefix = "scx_mlfq";
+
+/* ---- Time helpers ---- */
+static inline long long now_mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* ---- SCHED_EXT switch for the calling thread ---- */
+static void set_sched_ext_or_die(void)
+{
+    struct sched_param sp = { .sched_priority = 0 };
+
+    if (use_native)
+        return;
+
+    if (sched_setscheduler(0, SCHED_EXT, &sp) != 0) {
+        fprintf(stderr,
+            "sched_setscheduler(SCHED_EXT) failed: %s\n",
+            strerror(errno));
+        exit(1);
+    }
+}
+
+/* ---- I/O helpers ---- */
+static void write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* ---- Metrics scraping (OpenMetrics text from the scheduler loader) ---- */
+static char *scrape_metrics(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(metrics_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    size_t len = 0, cap = 65536;
+    char *buf;
+    int fd;
+
+    if (!metrics_port)
+        return NULL;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "metrics: cannot connect to 127.0.0.1:%u: %s\n",
+                metrics_port, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    write_full(fd, req, sizeof(req) - 1);
+
+    buf = malloc(cap);
+    while (buf) {
+        ssize_t n;
+
+        if (len + 1 == cap) {
+            char *nbuf = realloc(buf, cap * 2);
+            if (!nbuf)
+                break;
+            buf = nbuf;
+            cap *= 2;
+        }
+        n = read(fd, buf + len, cap - len - 1);
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+
+    if (buf)
+        buf[len] = '\0';
+    return buf;
+}
+
+/*
+ * Value of the first sample of @name (e.g. "scx_mlfq_dispatch_total"),
+ * with or without labels. Returns -1 if absent.
+ */
+static double metric_value(const char *text, const char *name)
+{
+    size_t nlen = strlen(name);
+    const char *line = text;
+
+    while (line && *line) {
+        if (!strncmp(line, name, nlen) &&
+            (line[nlen] == ' ' || line[nlen] == '{')) {
+            const char *v = strchr(line + nlen, ' ');
+            if (v)
+                return strtod(v + 1, NULL);
+        }
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+    return -1;
+}
+
+/* Scheduler counter @suffix (after "<prefix>_"), or -1 without metrics */
+static double sched_counter(const char *text, const char *suffix)
+{
+    char name[128];
+
+    if (!text)
+        return -1;
+    snprintf(name, sizeof(name), "%s_%s", metrics_prefix, suffix);
+    return metric_value(text, name);
+}
+
+/* Sum over every label set of gauge @suffix, or -1 if absent */
+static double sched_gauge_sum(const char *text, const char *suffix)
+{
+    char name[128];
+    const char *line = text;
+    double sum = -1;
+    size_t nlen;
+
+    if (!text)
+        return -1;
+    nlen = snprintf(name, sizeof(name), "%s_%s", metrics_prefix, suffix);
+
+    while (line && *line) {
+        if (!strncmp(line, name, nlen) &&
+            (line[nlen] == ' ' || line[nlen] == '{')) {
+            const char *v = line + nlen;
+
+            if (*v == '{')
+                v = strchr(v, '}');
+            v = v ? strchr(v, ' ') : NULL;
+            if (v)
+                sum = (sum < 0 ? 0 : sum) + strtod(v + 1, NULL);
+        }
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+    return sum;
+}
+
+/* ---- Start barrier shared by all benchmark threads ---- */
+static pthread_barrier_t start_barrier;
+
+/*
+ * ---- churn: hackbench-style message passing ----
+ *
+ * Each group has nr_fds senders and nr_fds receivers. Every sender writes
+ * `loops` messages to every receiver of its group through the receiver's
+ * pipe, so tasks constantly block and wake each other.
+ */
+struct churn_group {
+    int nr_fds;
+    int loops;
+    int (*pipes)[2];        /* one pipe per receiver */
+};
+
+struct churn_arg {
+    struct churn_group *grp;
+    int idx;
+};
+
+static void *churn_sender(void *data)
+{
+    struct churn_arg *a = data;
+    struct churn_group *g = a->grp;
+    char msg[MSG_SIZE] = { 0 };
+
+    set_sched_ext_or_die();
+    pthread_barrier_wait(&start_barrier);
+
+    for (int l = 0; l < g->loops; l++)
+        for (int r = 0; r < g->nr_fds; r++)
+            write_full(g->pipes[r][1], msg, sizeof(msg));
+
+    return NULL;
+}
+
+static void *churn_receiver(void *data)
+{
+    struct churn_arg *a = data;
+    struct churn_group *g = a->grp;
+    char msg[MSG_SIZE];
+    long total = (long)g->loops * g->nr_fds;
+
+    set_sched_ext_or_die();
+    pthread_barrier_wait(&start_barrier);
+
+    for (long i = 0; i < total; i++)
+        read_full(g->pipes[a->idx][0], msg, sizeof(msg));
+
+    return NULL;
+}
+
+static int run_churn(int nr_groups, int nr_fds, int loops)
+{
+    int nr_threads = nr_groups * nr_fds * 2;
+    struct churn_group *groups = calloc(nr_groups, sizeof(*groups));
+    struct churn_arg *args = calloc(nr_threads, sizeof(*args));
+    pthread_t *tids = calloc(nr_threads, sizeof(*tids));
+    char *m0, *m1;
+    long long t0, t1;
+    int t = 0;
+
+    if (!groups || !args || !tids)
+        return 1;
+
+    pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+
+    for (int g = 0; g < nr_groups; g++) {
+        groups[g].nr_fds = nr_fds;
+        groups[g].loops = loops;
+        groups[g].pipes = calloc(nr_fds, sizeof(*groups[g].pipes));
+        if (!groups[g].pipes)
+            return 1;
+
+        for (int r = 0; r < nr_fds; r++) {
+            if (pipe(groups[g].pipes[r]) != 0) {
+                perror("pipe");
+                return 1;
+            }
+        }
+
+        for (int i = 0; i < nr_fds; i++) {
+            args[t] = (struct churn_arg){ .grp = &groups[g], .idx = i };
+            pthread_create(&tids[t], NULL, churn_receiver, &args[t]);
+            t++;
+            args[t] = (struct churn_arg){ .grp = &groups[g], .idx = i };
+            pthread_create(&tids[t], NULL, churn_sender, &args[t]);
+            t++;
+        }
+    }
+
+    m0 = scrape_metrics();
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_mono_ns();
+
+    for (int i = 0; i < nr_threads; i++)
+        pthread_join(tids[i], NULL);
+
+    t1 = now_mono_ns();
+    m1 = scrape_metrics();
+
+    double secs = (double)(t1 - t0) / NS_PER_SEC;
+    long long msgs = (long long)nr_groups * nr_fds * nr_fds * loops;
+
+    printf("churn: groups=%d tasks=%d msgs=%lld time=%.3fs msgs/s=%.0f\n",
+           nr_groups, nr_threads, msgs, secs, msgs / secs);
+
+    if (m0 && m1) {
+        double d0 = sched_counter(m0, "dispatch_total");
+        double d1 = sched_counter(m1, "dispatch_total");
+        double u0 = sched_counter(m0, "dispatch_useful_total");
+        double u1 = sched_counter(m1, "dispatch_useful_total");
+
+        if (d0 >= 0 && d1 >= 0)
+            printf("sched: dispatch/s=%.0f useful/s=%.0f dispatch/msg=%.3f\n",
+                   (d1 - d0) / secs, (u1 - u0) / secs, (d1 - d0) / msgs);
+    }
+
+    free(m0);
+    free(m1);
+    for (int g = 0; g < nr_groups; g++) {
+        for (int r = 0; r < nr_fds; r++) {
+            close(groups[g].pipes[r][0]);
+            close(groups[g].pipes[r][1]);
+        }
+        free(groups[g].pipes);
+    }
+    free(groups);
+    free(args);
+    free(tids);
+    return 0;
+}
+
+/*
+ * ---- pingpong: two tasks bouncing a byte through a pair of pipes ----
+ *
+ * Every round trip is two wakeups and two context switches, so the time per
+ * switch is dominated by the scheduler's enqueue/dispatch/running/stopping
+ * path rather than by the work done between switches. The initiator also
+ * times every round trip; with "any" the RTT percentiles show whether the
+ * scheduler keeps the pair together or bounces it across CPUs and LLCs.
+ */
+struct pingpong_arg {
+    int rfd, wfd;
+    long rounds;
+    int initiator;
+    long long *rtt_ns;      /* initiator only: one entry per round */
+};
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* @pct-th percentile of a sorted array */
+static long long percentile(const long long *sorted, long n, double pct)
+{
+    long idx = (long)(pct / 100.0 * (n - 1) + 0.5);
+
+    return sorted[idx];
+}
+
+static void *pingpong_thread(void *data)
+{
+    struct pingpong_arg *a = data;
+    char c = 0;
+
+    set_sched_ext_or_die();
+    pthread_barrier_wait(&start_barrier);
+
+    for (long i = 0; i < a->rounds; i++) {
+        if (a->initiator) {
+            long long t = now_mono_ns();
+
+            write_full(a->wfd, &c, 1);
+            read_full(a->rfd, &c, 1);
+            a->rtt_ns[i] = now_mono_ns() - t;
+        } else {
+            read_full(a->rfd, &c, 1);
+            write_full(a->wfd, &c, 1);
+        }
+    }
+    return NULL;
+}
+
+static int run_pingpong(long rounds, int same_cpu)
+{
+    int ab[2], ba[2];
+    struct pingpong_arg args[2];
+    pthread_t tids[2];
+    long long t0, t1, *rtt;
+    char *m0, *m1;
+
+    rtt = malloc(rounds * sizeof(*rtt));
+    if (!rtt) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (pipe(ab) != 0 || pipe(ba) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    /* both on CPU 0 forces a full switch per hand-off, no idle wakeups */
+    if (same_cpu) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(0, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+            return 1;
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, 3);
+
+    args[0] = (struct pingpong_arg){ .rfd = ba[0], .wfd = ab[1],
+                                     .rounds = rounds, .initiator = 1,
+                                     .rtt_ns = rtt };
+    args[1] = (struct pingpong_arg){ .rfd = ab[0], .wfd = ba[1],
+                                     .rounds = rounds, .initiator = 0 };
+    for (int i = 0; i < 2; i++)
+        pthread_create(&tids[i], NULL, pingpong_thread, &args[i]);
+
+    /* scrape outside the timed window, as run_churn does */
+    m0 = scrape_metrics();
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_mono_ns();
+
+    for (int i = 0; i < 2; i++)
+        pthread_join(tids[i], NULL);
+
+    t1 = now_mono_ns();
+    m1 = scrape_metrics();
+
+    double ns = (double)(t1 - t0);
+    printf("pingpong: rounds=%ld cpus=%s time=%.3fs rtt=%.0fns ns/switch=%.0f\n",
+           rounds, same_cpu ? "0" : "any", ns / NS_PER_SEC,
+           ns / rounds, ns / (2.0 * rounds));
+
+    qsort(rtt, rounds, sizeof(*rtt), cmp_ll);
+    printf("pingpong: rtt_p50=%.1fus rtt_p99=%.1fus rtt_p999=%.1fus rtt_max=%.1fus\n",
+           percentile(rtt, rounds, 50) / 1e3, percentile(rtt, rounds, 99) / 1e3,
+           percentile(rtt, rounds, 99.9) / 1e3, rtt[rounds - 1] / 1e3);
+
+    /* share of wakeups the scheduler placed next to their waker */
+    if (m0 && m1) {
+        double s0 = sched_counter(m0, "wake_sync_total");
+        double s1 = sched_counter(m1, "wake_sync_total");
+        double l0 = sched_counter(m0, "wake_llc_total");
+        double l1 = sched_counter(m1, "wake_llc_total");
+
+        if (s0 >= 0 && s1 >= 0 && l0 >= 0 && l1 >= 0)
+            printf("sched: wake_sync/round=%.2f wake_llc/round=%.2f\n",
+                   (s1 - s0) / rounds, (l1 - l0) / rounds);
+    }
+
+    free(m0);
+    free(m1);
+    free(rtt);
+
+    for (int i = 0; i < 2; i++) {
+        close(ab[i]);
+        close(ba[i]);
+    }
+    return 0;
+}
+
+/*
+ * ---- pinned: many CPU-0-only tasks next to unpinned ones ----
+ *
+ * Every task loops on a short spin followed by a short sleep. A share of
+ * them is pinned to CPU 0, the way load_generator_v2 pins its children.
+ * When pinned tasks sit in a shared queue, every other CPU has to scan past
+ * them; that shows up as a higher wakeup latency for the unpinned tasks and
+ * as wasted dispatch calls on the scheduler side.
+ */
+#define PINNED_SPIN_NS  (50 * 1000LL)
+#define PINNED_SLEEP_NS (200 * 1000LL)
+
+struct pinned_arg {
+    int pinned;
+    long long deadline_ns;
+    long long loops;
+    long long lat_sum_ns;
+    long long lat_max_ns;
+};
+
+static void *pinned_thread(void *data)
+{
+    struct pinned_arg *a = data;
+    struct timespec req = { .tv_nsec = PINNED_SLEEP_NS };
+
+    if (a->pinned) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(0, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity");
+            exit(1);
+        }
+    }
+
+    set_sched_ext_or_die();
+    pthread_barrier_wait(&start_barrier);
+
+    while (now_mono_ns() < a->deadline_ns) {
+        long long t = now_mono_ns();
+
+        while (now_mono_ns() - t < PINNED_SPIN_NS)
+            ;
+
+        t = now_mono_ns();
+        nanosleep(&req, NULL);
+        t = now_mono_ns() - t - PINNED_SLEEP_NS;
+
+        a->lat_sum_ns += t;
+        if (t > a->lat_max_ns)
+            a->lat_max_ns = t;
+        a->loops++;
+    }
+    return NULL;
+}
+
+static int run_pinned(int nr_threads, int pct_pinned, int secs)
+{
+    struct pinned_arg *args = calloc(nr_threads, sizeof(*args));
+    pthread_t *tids = calloc(nr_threads, sizeof(*tids));
+    int nr_pinned = nr_threads * pct_pinned / 100;
+    long long deadline;
+    char *m0, *m1;
+
+    if (!args || !tids)
+        return 1;
+
+    pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+
+    /* leave time for thread start-up before the measured window */
+    deadline = now_mono_ns() + (secs + 1) * NS_PER_SEC;
+    for (int i = 0; i < nr_threads; i++) {
+        args[i].pinned = i < nr_pinned;
+        args[i].deadline_ns = deadline;
+        pthread_create(&tids[i], NULL, pinned_thread, &args[i]);
+    }
+
+    m0 = scrape_metrics();
+    pthread_barrier_wait(&start_barrier);
+    long long t0 = now_mono_ns();
+
+    for (int i = 0; i < nr_threads; i++)
+        pthread_join(tids[i], NULL);
+
+    double elapsed = (double)(now_mono_ns() - t0) / NS_PER_SEC;
+    m1 = scrape_metrics();
+
+    for (int pinned = 1; pinned >= 0; pinned--) {
+        long long loops = 0, lat_sum = 0, lat_max = 0;
+        int n = 0;
+
+        for (int i = 0; i < nr_threads; i++) {
+            if (args[i].pinned != pinned)
+                continue;
+            n++;
+            loops += args[i].loops;
+            lat_sum += args[i].lat_sum_ns;
+            if (args[i].lat_max_ns > lat_max)
+                lat_max = args[i].lat_max_ns;
+        }
+        if (!n)
+            continue;
+
+        printf("pinned: %-8s tasks=%d loops/s=%.0f wake_lat_avg=%.1fus wake_lat_max=%.1fus\n",
+               pinned ? "cpu0" : "unpinned", n, loops / elapsed,
+               loops ? lat_sum / 1e3 / loops : 0.0, lat_max / 1e3);
+    }
+
+    if (m0 && m1) {
+        double d0 = sched_counter(m0, "dispatch_total");
+        double d1 = sched_counter(m1, "dispatch_total");
+        double u0 = sched_counter(m0, "dispatch_useful_total");
+        double u1 = sched_counter(m1, "dispatch_useful_total");
+        double p0 = sched_counter(m0, "pinned_total");
+        double p1 = sched_counter(m1, "pinned_total");
+
+        if (d0 >= 0 && d1 >= 0)
+            printf("sched: dispatch/s=%.0f useful=%.1f%% pinned/s=%.0f\n",
+                   (d1 - d0) / elapsed,
+                   d1 > d0 ? 100.0 * (u1 - u0) / (d1 - d0) : 0.0,
+                   p0 >= 0 && p1 >= 0 ? (p1 - p0) / elapsed : 0.0);
+    }
+
+    free(m0);
+    free(m1);
+    free(args);
+    free(tids);
+    return 0;
+}
+
+/*
+ * ---- scale: tens of thousands of mostly sleeping tasks ----
+ *
+ * Every task sleeps for a random interval averaging 1/wake_hz, spins for
+ * SCALE_WORK_NS and goes back to sleep. After about SCALE_LIFE wakeups it
+ * starts its own replacement and exits, so tasks keep being created and
+ * torn down. The task count doubles every step up to max_tasks; each step
+ * reports the wakeup latency (oversleep) seen by the tasks and, with -p,
+ * the scheduler's tracked tasks against its task table capacity, lookups
+ * that missed the table, DSQ depth and enqueue-to-running latency.
+ */
+#define SCALE_WORK_NS    (2 * 1000LL)
+#define SCALE_LIFE       50
+#define SCALE_STACK      (64 << 10)
+#define SCALE_NR_BUCKETS 32             /* log2(ns) wakeup latency buckets */
+
+static volatile int scale_stop;
+static long scale_sleep_ns;             /* mean sleep */
+static long long scale_live;
+static long long scale_spawned;
+static long long scale_spawn_fail;
+static long long scale_wakeups;
+static long long scale_lat_sum_ns;
+static long long scale_lat_hist[SCALE_NR_BUCKETS];
+static pthread_attr_t scale_attr;
+
+static int spawn_scale_task(unsigned int seed);
+
+static void *scale_thread(void *data)
+{
+    unsigned int seed = (uintptr_t)data;
+    int life = 1 + rand_r(&seed) % (2 * SCALE_LIFE);
+
+    set_sched_ext_or_die();
+
+    while (!scale_stop && life--) {
+        long long sleep_ns = rand_r(&seed) % (2 * scale_sleep_ns + 1);
+        struct timespec req = {
+            .tv_sec = sleep_ns / NS_PER_SEC,
+            .tv_nsec = sleep_ns % NS_PER_SEC,
+        };
+        long long t = now_mono_ns(), lat;
+        int b = 0;
+
+        nanosleep(&req, NULL);
+        lat = now_mono_ns() - t - sleep_ns;
+        if (lat < 0)
+            lat = 0;
+        while (b < SCALE_NR_BUCKETS - 1 && (1LL << (b + 1)) <= lat)
+            b++;
+
+        __atomic_fetch_add(&scale_wakeups, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&scale_lat_sum_ns, lat, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&scale_lat_hist[b], 1, __ATOMIC_RELAXED);
+
+        t = now_mono_ns();
+        while (now_mono_ns() - t < SCALE_WORK_NS)
+            ;
+    }
+
+    if (!scale_stop)
+        spawn_scale_task(seed);
+    __atomic_fetch_sub(&scale_live, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static int spawn_scale_task(unsigned int seed)
+{
+    pthread_t tid;
+
+    __atomic_fetch_add(&scale_live, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&tid, &scale_attr, scale_thread, (void *)(uintptr_t)seed) != 0) {
+        __atomic_fetch_sub(&scale_live, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&scale_spawn_fail, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_fetch_add(&scale_spawned, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Upper bound (ns) of the bucket holding the @pct-th percentile */
+static long long scale_hist_pct(const long long *hist, long long n, double pct)
+{
+    long long want = (long long)(n * pct / 100.0), seen = 0;
+
+    for (int b = 0; b < SCALE_NR_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want)
+            return 1LL << (b + 1);
+    }
+    return 1LL << SCALE_NR_BUCKETS;
+}
+
+struct scale_snap {
+    long long wakeups, lat_sum_ns, spawned;
+    long long hist[SCALE_NR_BUCKETS];
+};
+
+static void scale_snapshot(struct scale_snap *s)
+{
+    s->wakeups = __atomic_load_n(&scale_wakeups, __ATOMIC_RELAXED);
+    s->lat_sum_ns = __atomic_load_n(&scale_lat_sum_ns, __ATOMIC_RELAXED);
+    s->spawned = __atomic_load_n(&scale_spawned, __ATOMIC_RELAXED);
+    for (int b = 0; b < SCALE_NR_BUCKETS; b++)
+        s->hist[b] = __atomic_load_n(&scale_lat_hist[b], __ATOMIC_RELAXED);
+}
+
+static void scale_report_sched(const char *m0, const char *m1, double elapsed)
+{
+    double miss0 = sched_counter(m0, "ctx_miss_total");
+    double miss1 = sched_counter(m1, "ctx_miss_total");
+    double d0 = sched_counter(m0, "dispatch_total");
+    double d1 = sched_counter(m1, "dispatch_total");
+    double w0 = sched_counter(m0, "hi_waits_total");
+    double w1 = sched_counter(m1, "hi_waits_total");
+    double wn0 = sched_counter(m0, "hi_wait_ns_total");
+    double wn1 = sched_counter(m1, "hi_wait_ns_total");
+    double tracked = sched_gauge_sum(m1, "tasks");
+    double cap = sched_gauge_sum(m1, "task_ctx_capacity");
+    double depth = sched_gauge_sum(m1, "dsq_depth");
+
+    printf("sched:");
+    if (tracked >= 0)
+        printf(" tracked=%.0f", tracked);
+    if (tracked >= 0 && cap > 0)
+        printf("/%.0f (%.0f%%)", cap, 100.0 * tracked / cap);
+    if (miss0 >= 0 && miss1 >= 0)
+        printf(" ctx_miss/s=%.0f", (miss1 - miss0) / elapsed);
+    if (depth >= 0)
+        printf(" dsq_depth=%.0f", depth);
+    if (d0 >= 0 && d1 >= 0)
+        printf(" dispatch/s=%.0f", (d1 - d0) / elapsed);
+    if (w1 > w0 && wn0 >= 0 && wn1 >= 0)
+        printf(" hi_wait_avg=%.1fus", (wn1 - wn0) / (w1 - w0) / 1e3);
+    printf("\n");
+}
+
+static int run_scale(int max_tasks, int wake_hz, int secs)
+{
+    int tasks = max_tasks / 8 > 0 ? max_tasks / 8 : 1;
+    unsigned int seed = 1;
+    int ret = 0;
+
+    scale_sleep_ns = NS_PER_SEC / wake_hz;
+    pthread_attr_init(&scale_attr);
+    pthread_attr_setdetachstate(&scale_attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&scale_attr, SCALE_STACK);
+
+    for (;;) {
+        struct scale_snap s0, s1;
+        long long hist[SCALE_NR_BUCKETS], n;
+        char *m0, *m1;
+
+        /* top up to the step's task count, outside the measured window */
+        while (__atomic_load_n(&scale_live, __ATOMIC_RELAXED) < tasks) {
+            if (spawn_scale_task(seed++)) {
+                fprintf(stderr, "scale: cannot create task %lld "
+                        "(check ulimit -u, kernel.threads-max, kernel.pid_max)\n",
+                        __atomic_load_n(&scale_live, __ATOMIC_RELAXED) + 1);
+                ret = 1;
+                goto out;
+            }
+        }
+        sleep(1);       /* let the new tasks settle into their sleep cycle */
+
+        scale_snapshot(&s0);
+        m0 = scrape_metrics();
+        long long t0 = now_mono_ns();
+        sleep(secs);
+        double elapsed = (double)(now_mono_ns() - t0) / NS_PER_SEC;
+        m1 = scrape_metrics();
+        scale_snapshot(&s1);
+
+        n = s1.wakeups - s0.wakeups;
+        for (int b = 0; b < SCALE_NR_BUCKETS; b++)
+            hist[b] = s1.hist[b] - s0.hist[b];
+
+        printf("scale: tasks=%d live=%lld wakeups/s=%.0f spawn/s=%.0f "
+               "wake_lat_avg=%.1fus p50<=%.1fus p99<=%.1fus\n",
+               tasks, __atomic_load_n(&scale_live, __ATOMIC_RELAXED),
+               n / elapsed, (s1.spawned - s0.spawned) / elapsed,
+               n ? (s1.lat_sum_ns - s0.lat_sum_ns) / 1e3 / n : 0.0,
+               scale_hist_pct(hist, n, 50) / 1e3, scale_hist_pct(hist, n, 99) / 1e3);
+        if (m0 && m1)
+            scale_report_sched(m0, m1, elapsed);
+        fflush(stdout);
+
+        free(m0);
+        free(m1);
+
+        if (tasks == max_tasks)
+            break;
+        tasks = tasks * 2 < max_tasks ? tasks * 2 : max_tasks;
+    }
+
+out:
+    scale_stop = 1;
+    /* every task notices within one sleep interval (at most 2/wake_hz) */
+    while (__atomic_load_n(&scale_live, __ATOMIC_RELAXED) > 0)
+        usleep(10000);
+    if (scale_spawn_fail)
+        printf("scale: %lld replacement tasks could not be created\n", scale_spawn_fail);
+    pthread_attr_destroy(&scale_attr);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-N] [-p port] [-s prefix] <mode> [mode options]\n"
+        "  -N  stay on the default scheduler (baseline run)\n"
+        "  -p  scrape scheduler metrics from 127.0.0.1:port before/after\n"
+        "  -s  metric name prefix (default scx_mlfq)\n"
+        "modes:\n"
+        "  churn [groups] [fds] [loops]   hackbench-style pipe churn (default 10 20 100)\n"
+        "  pingpong [rounds] [any]        two tasks on CPU 0 (or any CPU) bouncing a byte\n"
+        "                                 (default 100000); ns per switch, RTT percentiles\n"
+        "  pinned [tasks] [pct] [secs]    spin/sleep loops with pct%% of tasks pinned to CPU 0\n"
+        "                                 (default 4*ncpus 75 5); wakeup latency per group\n"
+        "  scale [tasks] [wake_hz] [secs] sleeping tasks waking wake_hz times a second, count\n"
+        "                                 doubling up to tasks (default 10000 10 5); wakeup\n"
+        "                                 latency and scheduler table/queue metrics per step\n",
+        prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+Np:s:h")) != -1) {
+        switch (opt) {
+        case 'N':
+            use_native = 1;
+            break;
+        case 'p':
+            metrics_port = atoi(optarg);
+            break;
+        case 's':
+            metrics_prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *mode = argv[optind];
+    int nargs = argc - optind - 1;
+    char **margs = argv + optind + 1;
+
+    if (!strcmp(mode, "churn")) {
+        int groups = nargs > 0 ? atoi(margs[0]) : 10;
+        int fds    = nargs > 1 ? atoi(margs[1]) : 20;
+        int loops  = nargs > 2 ? atoi(margs[2]) : 100;
+
+        if (groups < 1 || fds < 1 || loops < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run_churn(groups, fds, loops);
+    }
+
+    if (!strcmp(mode, "pingpong")) {
+        long rounds = nargs > 0 ? atol(margs[0]) : 100000;
+        int same_cpu = !(nargs > 1 && !strcmp(margs[1], "any"));
+
+        if (rounds < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run_pingpong(rounds, same_cpu);
+    }
+
+    if (!strcmp(mode, "pinned")) {
+        int tasks = nargs > 0 ? atoi(margs[0]) : 4 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+        int pct   = nargs > 1 ? atoi(margs[1]) : 75;
+        int secs  = nargs > 2 ? atoi(margs[2]) : 5;
+
+        if (tasks < 1 || pct < 0 || pct > 100 || secs < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run_pinned(tasks, pct, secs);
+    }
+
+    if (!strcmp(mode, "scale")) {
+        int tasks = nargs > 0 ? atoi(margs[0]) : 10000;
+        int hz    = nargs > 1 ? atoi(margs[1]) : 10;
+        int secs  = nargs > 2 ? atoi(margs[2]) : 5;
+
+        if (tasks < 1 || hz < 1 || secs < 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return run_scale(tasks, hz, secs);
+    }
+
+    usage(argv[0]);
+    return 1;
+}
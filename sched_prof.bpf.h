@@ -0,0 +1,68 @@
+/*
+ * sched_prof.bpf.h - self-overhead profiling for the *_prof scheduler builds
+ *
+ * Include only in profiling builds. PROF_SCOPE() at the top of a callback
+ * times it until it returns, early returns included, into a per-CPU log2
+ * histogram in the prof map. Other builds define PROF_SCOPE() as empty, so
+ * neither the timing nor the map exists there.
+ */
+#ifndef __SCHED_PROF_BPF_H
+#define __SCHED_PROF_BPF_H
+
+#include "sched_prof.h"
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(struct prof_hist));
+	__uint(max_entries, PROF_NR);
+} prof SEC(".maps");
+
+struct prof_scope {
+	u64 t0;
+	u32 cb;
+};
+
+static __always_inline u32 log2_u32(u32 v)
+{
+	u32 r, shift;
+
+	r = (v > 0xFFFF) << 4; v >>= r;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+	return r;
+}
+
+static __always_inline u32 log2_u64(u64 v)
+{
+	u32 hi = v >> 32;
+
+	return hi ? log2_u32(hi) + 32 : log2_u32(v);
+}
+
+static __always_inline void prof_scope_end(struct prof_scope *ps)
+{
+	u64 delta = bpf_ktime_get_ns() - ps->t0;
+	struct prof_hist *h;
+	u32 bucket;
+
+	h = bpf_map_lookup_elem(&prof, &ps->cb);
+	if (!h)
+		return;
+
+	bucket = log2_u64(delta);
+	if (bucket >= PROF_NR_BUCKETS)
+		bucket = PROF_NR_BUCKETS - 1;
+
+	h->count++;
+	h->sum_ns += delta;
+	h->buckets[bucket]++;
+}
+
+#define PROF_SCOPE(id)							\
+	struct prof_scope __prof __attribute__((cleanup(prof_scope_end))) = \
+		{ .t0 = bpf_ktime_get_ns(), .cb = (id) }
+
+#endif /* __SCHED_PROF_BPF_H */
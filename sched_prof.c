@@ -0,0 +1,143 @@
+/*
+ * sched_prof.c - loader half of the *_prof scheduler builds
+ *
+ * Reads the per-CPU prof map written by sched_prof.bpf.h and reports the
+ * interval since the previous read. Callbacks a scheduler does not time
+ * never get a call and are skipped.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <linux/types.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "sched_prof.h"
+#include "metrics_http.h"
+
+static const char *const prof_names[PROF_NR] = {
+	[PROF_SELECT_CPU]	= "select_cpu",
+	[PROF_ENQUEUE]		= "enqueue",
+	[PROF_DISPATCH]		= "dispatch",
+	[PROF_RUNNING]		= "running",
+	[PROF_STOPPING]		= "stopping",
+	[PROF_ENABLE]		= "enable",
+	[PROF_DISABLE]		= "disable",
+	[PROF_TICK]		= "tick",
+};
+
+static double mono_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sched_prof_reset(struct sched_prof *sp, int map_fd)
+{
+	memset(sp, 0, sizeof(*sp));
+	sp->map_fd = map_fd;
+	sp->last_s = mono_s();
+}
+
+static void read_prof(struct sched_prof *sp)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct prof_hist vals[nr_cpus];
+	__u32 idx;
+
+	memcpy(sp->prev, sp->cur, sizeof(sp->cur));
+	memset(sp->cur, 0, sizeof(sp->cur));
+
+	for (idx = 0; idx < PROF_NR; idx++) {
+		int cpu, b;
+
+		if (bpf_map_lookup_elem(sp->map_fd, &idx, vals) < 0)
+			continue;
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			sp->cur[idx].count += vals[cpu].count;
+			sp->cur[idx].sum_ns += vals[cpu].sum_ns;
+			for (b = 0; b < PROF_NR_BUCKETS; b++)
+				sp->cur[idx].buckets[b] += vals[cpu].buckets[b];
+		}
+	}
+}
+
+/* p99 of a log2 histogram, interpolated linearly inside the bucket */
+static double prof_p99(const struct prof_hist *cur, const struct prof_hist *prev)
+{
+	__u64 count = cur->count - prev->count;
+	double target = 0.99 * count, seen = 0;
+	int b;
+
+	if (!count)
+		return 0;
+
+	for (b = 0; b < PROF_NR_BUCKETS; b++) {
+		double n = cur->buckets[b] - prev->buckets[b];
+		double lo = b ? (double)(1ULL << b) : 0;
+
+		if (seen + n >= target)
+			return lo + (n ? (target - seen) / n : 0) * ((double)(2ULL << b) - lo);
+		seen += n;
+	}
+	return (double)(1ULL << (PROF_NR_BUCKETS - 1));
+}
+
+void sched_prof_poll(struct sched_prof *sp, unsigned int interval_ms)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	double now = mono_s(), interval_s = now - sp->last_s;
+	double total_ns = 0;
+	int i;
+
+	if (interval_s < interval_ms / 1e3)
+		return;
+	sp->last_s = now;
+
+	read_prof(sp);
+
+	printf("%-12s %12s %10s %10s\n", "callback", "calls/s", "mean(ns)", "p99(ns)");
+	for (i = 0; i < PROF_NR; i++) {
+		__u64 calls = sp->cur[i].count - sp->prev[i].count;
+		__u64 ns = sp->cur[i].sum_ns - sp->prev[i].sum_ns;
+
+		if (!sp->cur[i].count)
+			continue;
+		printf("%-12s %12.0f %10.0f %10.0f\n", prof_names[i],
+		       calls / interval_s, calls ? (double)ns / calls : 0.0,
+		       prof_p99(&sp->cur[i], &sp->prev[i]));
+		total_ns += ns;
+	}
+	printf("scheduler CPU share: %.4f%% of %d CPUs\n",
+	       100.0 * total_ns / (interval_s * 1e9 * nr_cpus), nr_cpus);
+	fflush(stdout);
+}
+
+void sched_prof_metrics(const struct sched_prof *sp, struct metrics_buf *mb,
+			const char *prefix)
+{
+	char name[64], label[32];
+	int i;
+
+	snprintf(name, sizeof(name), "%s_prof_calls", prefix);
+	metrics_family(mb, name, "counter", "Profiled struct_ops callback invocations");
+	for (i = 0; i < PROF_NR; i++) {
+		if (!sp->cur[i].count)
+			continue;
+		snprintf(label, sizeof(label), "cb=\"%s\"", prof_names[i]);
+		metrics_counter(mb, name, label, sp->cur[i].count);
+	}
+
+	snprintf(name, sizeof(name), "%s_prof_ns", prefix);
+	metrics_family(mb, name, "counter", "Nanoseconds spent in profiled struct_ops callbacks");
+	for (i = 0; i < PROF_NR; i++) {
+		if (!sp->cur[i].count)
+			continue;
+		snprintf(label, sizeof(label), "cb=\"%s\"", prof_names[i]);
+		metrics_counter(mb, name, label, sp->cur[i].sum_ns);
+	}
+}
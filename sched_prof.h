@@ -0,0 +1,57 @@
+/* sched_prof.h - per-callback cost histograms of the *_prof scheduler builds */
+#ifndef __SCHED_PROF_H
+#define __SCHED_PROF_H
+
+/*
+ * Callbacks that can be timed. A scheduler times the ones it implements;
+ * the rest stay at zero calls and are left out of reports.
+ */
+enum prof_cb {
+	PROF_SELECT_CPU = 0,
+	PROF_ENQUEUE = 1,
+	PROF_DISPATCH = 2,
+	PROF_RUNNING = 3,
+	PROF_STOPPING = 4,
+	PROF_ENABLE = 5,
+	PROF_DISABLE = 6,
+	PROF_TICK = 7,
+	PROF_NR,
+};
+
+/* log2(ns) latency buckets; the last one also takes everything above */
+#define PROF_NR_BUCKETS 32
+
+struct prof_hist {
+	__u64 count;
+	__u64 sum_ns;
+	__u64 buckets[PROF_NR_BUCKETS];
+};
+
+#ifndef __bpf__
+struct metrics_buf;
+
+/*
+ * Loader side: cumulative histograms summed over CPUs as of the last read,
+ * and the ones before, so reports cover the interval in between.
+ */
+struct sched_prof {
+	int map_fd;
+	double last_s;			/* CLOCK_MONOTONIC of the last report */
+	struct prof_hist cur[PROF_NR], prev[PROF_NR];
+};
+
+/* Start over on a freshly loaded prof map */
+void sched_prof_reset(struct sched_prof *sp, int map_fd);
+
+/*
+ * Once @interval_ms has passed since the last report, print calls/s, mean
+ * and p99 per callback and the scheduler's share of CPU time.
+ */
+void sched_prof_poll(struct sched_prof *sp, unsigned int interval_ms);
+
+/* <prefix>_prof_calls and <prefix>_prof_ns counters, labelled by callback */
+void sched_prof_metrics(const struct sched_prof *sp, struct metrics_buf *mb,
+			const char *prefix);
+#endif
+
+#endif /* __SCHED_PROF_H */
@@ -4,13 +4,27 @@ char _license[] SEC("license") = "GPL";
 
 UEI_DEFINE(uei);
 
+#ifndef SCHED_EXT
+#define SCHED_EXT 7
+#endif
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(key_size, sizeof(u32));
 	__uint(value_size, sizeof(u64));
-	__uint(max_entries, 2);
+	__uint(max_entries, 4);   /* local fastpath, global enqueue, pinned, sync wakeup */
 } stats SEC(".maps");
 
+/* FIFO_PROFILE builds time every callback, see sched_prof.bpf.h */
+#ifdef FIFO_PROFILE
+#include "sched_prof.bpf.h"
+#else
+#define PROF_SCOPE(id)
+#endif
+
+/* Gauge read by the loader from .bss: SCX_DSQ_GLOBAL length at the last dispatch */
+u64 global_depth;
+
 static __always_inline void stat_inc(u32 idx)
 {
 	u64 *cnt = bpf_map_lookup_elem(&stats, &idx);
@@ -18,11 +32,69 @@ static __always_inline void stat_inc(u32 idx)
 		(*cnt)++;
 }
 
+/*
+ * preempt_count() bits of hard and soft IRQ (or BH-disabled) and NMI
+ * context, read as the kernel selftests' bpf_in_interrupt() does. Where
+ * the count cannot be read, every wakeup is taken for an interrupt one.
+ */
+#define IRQ_CONTEXT_MASK	0x00ffff00U
+
+struct pcpu_hot___fifo {
+	int preempt_count;
+} __attribute__((preserve_access_index));
+
+extern struct pcpu_hot___fifo pcpu_hot __ksym __weak;
+extern int __preempt_count __ksym __weak;
+
+static __always_inline bool in_irq_context(void)
+{
+#if defined(__TARGET_ARCH_x86)
+	if (bpf_ksym_exists(&__preempt_count))
+		return *(int *)bpf_this_cpu_ptr(&__preempt_count) & IRQ_CONTEXT_MASK;
+	if (bpf_ksym_exists(&pcpu_hot))
+		return ((struct pcpu_hot___fifo *)bpf_this_cpu_ptr(&pcpu_hot))->preempt_count &
+		       IRQ_CONTEXT_MASK;
+#elif defined(__TARGET_ARCH_arm64)
+	return bpf_get_current_task_btf()->thread_info.preempt.count & IRQ_CONTEXT_MASK;
+#endif
+	return true;
+}
+
+/*
+ * A sync waker is about to block, so the wakee runs next on the waker's CPU
+ * where the data it was just handed is still in cache. Only done for
+ * SCHED_EXT wakers: ending the waker's slice here bounds the wait for one
+ * that keeps running after all. From interrupt context, current is just
+ * whatever task was interrupted, not the waker, so it is left alone.
+ */
+static __always_inline s32 sync_wake_cpu(struct task_struct *p, u64 wake_flags)
+{
+	struct task_struct *waker = bpf_get_current_task_btf();
+	s32 cpu = bpf_get_smp_processor_id();
+
+	if (!(wake_flags & SCX_WAKE_SYNC) || in_irq_context() ||
+	    waker->policy != SCHED_EXT ||
+	    p->nr_cpus_allowed == 1 || !bpf_cpumask_test_cpu(cpu, p->cpus_ptr) ||
+	    scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu))
+		return -1;
+
+	waker->scx.slice = 0;
+	return cpu;
+}
+
 s32 BPF_STRUCT_OPS(fifo_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
 {
+	PROF_SCOPE(PROF_SELECT_CPU);
 	bool is_idle = false;
 	s32 cpu;
 
+	cpu = sync_wake_cpu(p, wake_flags);
+	if (cpu >= 0) {
+		stat_inc(3);
+		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, SCX_SLICE_INF, 0);
+		return cpu;
+	}
+
 	cpu = scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
 
 	if (is_idle) {
@@ -35,12 +107,28 @@ s32 BPF_STRUCT_OPS(fifo_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wak
 
 void BPF_STRUCT_OPS(fifo_enqueue, struct task_struct *p, u64 enq_flags)
 {
+	PROF_SCOPE(PROF_ENQUEUE);
+	/*
+	 * A task that can only run on one CPU goes straight to that CPU's local
+	 * DSQ, so other CPUs never have to skip over it in the global queue.
+	 */
+	if (p->nr_cpus_allowed == 1) {
+		s32 cpu = bpf_cpumask_first(p->cpus_ptr);
+
+		stat_inc(2);
+		scx_bpf_dispatch(p, SCX_DSQ_LOCAL_ON | cpu, SCX_SLICE_INF, enq_flags);
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+		return;
+	}
+
 	stat_inc(1);
 	scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_INF, enq_flags);
 }
 
 void BPF_STRUCT_OPS(fifo_dispatch, s32 cpu, struct task_struct *prev)
 {
+	PROF_SCOPE(PROF_DISPATCH);
+	global_depth = scx_bpf_dsq_nr_queued(SCX_DSQ_GLOBAL);
 	scx_bpf_consume(SCX_DSQ_GLOBAL);
 }
 
@@ -4,14 +4,33 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <libgen.h>
+#include <time.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <scx/common.h>
 #include "scx_fifo.bpf.skel.h"
+#include "metrics_http.h"
+#include "state_pin.h"
+#include "sched_prof.h"
 
+/* Counters survive restarts and redeploys in bpffs (state_pin.h); -F drops them */
+#define FIFO_STATE_DIR "/sys/fs/bpf/scx_fifo"
+#define FIFO_STATE_VERSION 1
+
+static const char *const state_maps[] = { "stats", NULL };
 
 static bool verbose;
+static bool fresh_state;
 static volatile int exit_req;
+static unsigned short metrics_port;
+static double attach_s;
+
+#ifdef FIFO_PROFILE
+/* Callback cost report interval of the profiling build (scx_fifo_prof) */
+#define PROF_REPORT_MS 1000
+
+static struct sched_prof prof;
+#endif
 
 static int libbpf_print_fn(enum libbpf_print_level level,
 			   const char *format, va_list args)
@@ -21,24 +40,35 @@ static int libbpf_print_fn(enum libbpf_print_level level,
 	return vfprintf(stderr, format, args);
 }
 
+static double mono_now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void sigint_handler(int sig)
 {
 	(void)sig;
 	exit_req = 1;
 }
 
-// stats[0]=local, stats[1]=global-enqueue
-static void read_stats(struct scx_fifo *skel, __u64 stats_out[2])
+#define NR_STATS 4
+
+// stats[0]=local, stats[1]=global-enqueue, stats[2]=pinned (local DSQ of its only CPU),
+// stats[3]=sync wakeups run next on the waker's CPU
+static void read_stats(struct scx_fifo *skel, __u64 stats_out[NR_STATS])
 {
 	int nr_cpus = libbpf_num_possible_cpus();
-	__u64 cnts[2][nr_cpus];
+	__u64 cnts[NR_STATS][nr_cpus];
 	__u32 idx;
 
-	stats_out[0] = stats_out[1] = 0;
-
-	for (idx = 0; idx < 2; idx++) {
+	for (idx = 0; idx < NR_STATS; idx++) {
 		int ret, cpu;
 
+		stats_out[idx] = 0;
+
 		ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.stats), &idx, cnts[idx]);
 		if (ret < 0)
 			continue;
@@ -48,40 +78,125 @@ static void read_stats(struct scx_fifo *skel, __u64 stats_out[2])
 	}
 }
 
+static void render_metrics(struct scx_fifo *skel, const __u64 st[NR_STATS],
+			   struct metrics_buf *mb)
+{
+	metrics_buf_reset(mb);
+	metrics_family(mb, "scx_fifo_local_fastpath", "counter",
+		       "Wakeups dispatched straight to an idle CPU's local DSQ");
+	metrics_counter(mb, "scx_fifo_local_fastpath", NULL, st[0]);
+	metrics_family(mb, "scx_fifo_global_enqueue", "counter",
+		       "Tasks enqueued on SCX_DSQ_GLOBAL");
+	metrics_counter(mb, "scx_fifo_global_enqueue", NULL, st[1]);
+	metrics_family(mb, "scx_fifo_pinned", "counter",
+		       "Single-CPU tasks enqueued on their CPU's local DSQ");
+	metrics_counter(mb, "scx_fifo_pinned", NULL, st[2]);
+	metrics_family(mb, "scx_fifo_sync_wakeup", "counter",
+		       "Sync wakeups dispatched to the waker's local DSQ");
+	metrics_counter(mb, "scx_fifo_sync_wakeup", NULL, st[3]);
+	metrics_family(mb, "scx_fifo_dsq_depth", "gauge",
+		       "Tasks queued on SCX_DSQ_GLOBAL at the last dispatch");
+	metrics_gauge(mb, "scx_fifo_dsq_depth", NULL, skel->bss->global_depth);
+	metrics_family(mb, "scx_fifo_attach_seconds", "gauge",
+		       "Time from opening the BPF object to attached, last load");
+	metrics_gauge(mb, "scx_fifo_attach_seconds", NULL, attach_s);
+#ifdef FIFO_PROFILE
+	sched_prof_metrics(&prof, mb, "scx_fifo");
+#endif
+	metrics_finish(mb);
+}
 
 int main(int argc, char **argv)
 {
 	struct scx_fifo *skel;
 	struct bpf_link *link;
-	int ecode;
+	struct metrics_server *msrv = NULL;
+	struct metrics_buf mb = {};
+	struct state_meta meta = {};
+	double open_s, detach_s = 0;
+	int ecode, opt, reused;
 
 	libbpf_set_print(libbpf_print_fn);
 	signal(SIGINT, sigint_handler);
 	signal(SIGTERM, sigint_handler);
 
+	while ((opt = getopt(argc, argv, "p:Fvh")) != -1) {
+		switch (opt) {
+		case 'p':
+			metrics_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			fresh_state = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p port] [-F] [-v]\n"
+				"  -p  serve OpenMetrics on 127.0.0.1:port/metrics\n"
+				"  -F  discard the counters pinned in " FIFO_STATE_DIR " by an earlier run\n",
+				basename(argv[0]));
+			return opt != 'h';
+		}
+	}
+
+	if (metrics_port)
+		msrv = metrics_server_start(metrics_port);
+
 restart:
+	open_s = mono_now_s();
 	skel = SCX_OPS_OPEN(fifo_ops, scx_fifo);
 
+	reused = state_pin_reuse(skel->obj, FIFO_STATE_DIR, state_maps,
+				 FIFO_STATE_VERSION, fresh_state);
+	fresh_state = false;
+
 	SCX_OPS_LOAD(skel, fifo_ops, scx_fifo, uei);
+	state_pin_save(skel->obj, FIFO_STATE_DIR, state_maps, FIFO_STATE_VERSION, &meta);
 	link = SCX_OPS_ATTACH(skel, fifo_ops, scx_fifo);
 
+	attach_s = mono_now_s() - open_s;
+	printf("state: %s (load %llu), attached in %.1fms",
+	       reused > 0 ? "reused pinned counters" : "fresh",
+	       (unsigned long long)meta.loads, attach_s * 1e3);
+	if (detach_s)
+		printf(", %.1fms after the restart", (mono_now_s() - detach_s) * 1e3);
+	printf("\n");
+
+#ifdef FIFO_PROFILE
+	sched_prof_reset(&prof, bpf_map__fd(skel->maps.prof));
+#endif
+
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
-		__u64 st[2];
+		__u64 st[NR_STATS];
 
 		read_stats(skel, st);
-		printf("stats: local_fastpath=%llu global_enq=%llu\n",
+		printf("stats: local_fastpath=%llu global_enq=%llu pinned=%llu sync=%llu\n",
 		       (unsigned long long)st[0],
-		       (unsigned long long)st[1]);
+		       (unsigned long long)st[1],
+		       (unsigned long long)st[2],
+		       (unsigned long long)st[3]);
+#ifdef FIFO_PROFILE
+		sched_prof_poll(&prof, PROF_REPORT_MS);
+#endif
 		fflush(stdout);
+
+		if (msrv) {
+			render_metrics(skel, st, &mb);
+			metrics_server_publish(msrv, &mb);
+		}
 		sleep(1);
 	}
 
 	bpf_link__destroy(link);
+	detach_s = mono_now_s();
 	ecode = UEI_REPORT(skel, uei);
 	scx_fifo__destroy(skel);
 
 	if (ecode == SCX_ECODE_ACT_RESTART)
 		goto restart;
 
+	metrics_server_stop(msrv);
+	metrics_buf_free(&mb);
 	return 0;
 }
@@ -4,6 +4,7 @@
 #endif
 
 #include <scx/common.bpf.h>
+#include "scx_mlfq.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -12,134 +13,1448 @@ UEI_DEFINE(uei);
 /* DSQs */
 #define DSQ_HI 0
 #define DSQ_LO 1
+#define DSQ_USER 2	/* tasks ordered by the userspace policy */
 
+/* Per-CPU DSQs, one per level, for tasks that can only run on that CPU */
+#define DSQ_PCPU_BASE 16
+#define DSQ_PCPU(cpu, level) (DSQ_PCPU_BASE + (u64)(cpu) * MLFQ_NR_LEVELS + (level))
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+#define NS_PER_US 1000ULL
 #define NS_PER_MS 1000000ULL
 #define HI_SLICE_NS (50ULL * NS_PER_MS)   /* 50ms */
 
-/* Only emit events for CPU0 (matches your CPU0 testing) */
-#define TRACE_CPU 0
+/* Only emit events for CPU0 (matches your CPU0 testing) */
+#define TRACE_CPU 0
+
+/*
+ * Optional features, fixed by the loader before load so the verifier drops
+ * the disabled paths entirely: the stats map and DSQ depth gauges, ringbuf
+ * events, and per-task migration/usage accounting. MLFQ_MINIMAL builds
+ * start with all of them off.
+ */
+#ifdef MLFQ_MINIMAL
+#define MLFQ_FEATURE_DEFAULT false
+#else
+#define MLFQ_FEATURE_DEFAULT true
+#endif
+
+const volatile bool enable_stats = MLFQ_FEATURE_DEFAULT;
+const volatile bool enable_events = MLFQ_FEATURE_DEFAULT;
+const volatile bool enable_task_acct = MLFQ_FEATURE_DEFAULT;
+
+/* Per-tgid and per-comm aggregates, off unless the loader asks (-g) */
+const volatile bool enable_agg;
+
+/*
+ * Timeline tracing, set by the loader. When trace_all is on, enqueue,
+ * running and stopping are recorded on every CPU for 1 in 2^trace_sample_shift
+ * pids, and events are dropped (and counted) once more than trace_max_backlog
+ * bytes are waiting in the ringbuf.
+ */
+const volatile bool trace_all;
+const volatile u32 trace_sample_shift;
+const volatile u64 trace_max_backlog = 1 << 19;
+
+/*
+ * Cache affinity for LO tasks: a LO task that ran within cache_hot_ns goes
+ * back to its previous CPU unless that CPU stays busy for longer than
+ * migration_cost_ns. Both are set by the loader; 0 disables stickiness.
+ */
+const volatile u64 cache_hot_ns = 5ULL * NS_PER_MS;
+const volatile u64 migration_cost_ns = 500ULL * NS_PER_US;
+
+/*
+ * Max HI tasks moved into the local DSQ per mlfq_dispatch call. LO tasks run
+ * with SCX_SLICE_INF, so at most one is ever pulled at a time. Tasks batched
+ * onto this CPU wait behind each other even while other CPUs are idle, so
+ * anything above 1 is for short-burst workloads only (-b).
+ */
+const volatile u32 dispatch_batch = 1;
+
+/*
+ * User-space-assisted mode: runnable tasks are handed to the loader's policy
+ * thread and dispatched in the order it returns. A task whose decision has
+ * not arrived within user_timeout_ns is dispatched by BPF as usual, so a
+ * stalled policy thread degrades to plain MLFQ instead of stalling tasks.
+ * Single-CPU tasks bypass the policy and go to their CPU's DSQ.
+ */
+const volatile bool user_mode;
+const volatile u64 user_timeout_ns = 5ULL * NS_PER_MS;
+const volatile u64 user_tick_ns = 1ULL * NS_PER_MS;
+
+/*
+ * Fork-storm control. A new task starts at its parent's level, and in LO if
+ * the parent is HI but has been running more than inherit_busy_pct of the
+ * recent past. Fresh HI tasks are further rate-limited per parent tgid to
+ * admit_rate per second with bursts of admit_burst; the rest start in LO.
+ * admit_rate 0 disables the limit.
+ */
+const volatile u64 usage_window_ns = 100ULL * NS_PER_MS;
+const volatile u32 inherit_busy_pct = 50;
+const volatile u32 admit_rate = 64;
+const volatile u32 admit_burst = 32;
+
+/*
+ * Lock-holder slice extension: a HI task whose slice expires while its
+ * slice_hint says it is inside a critical section runs for up to
+ * slice_ext_ns more, once per slice. The time it uses comes off its next
+ * HI slice, down to at most half of HI_SLICE_NS: the stop that ends an
+ * extension never demotes, so that next slice is a HI one. 0 disables
+ * extensions.
+ */
+const volatile u64 slice_ext_ns = 2ULL * NS_PER_MS;
+
+/*
+ * Partition mode: CPUs flagged in cpu_interactive only run HI tasks (and LO
+ * tasks pinned to them), the rest run everything. The loader resizes the
+ * interactive set at runtime from the HI wait time, so the flags live in .bss.
+ */
+const volatile bool partition_mode;
+
+/*
+ * Wake affinity: every task keeps a majority-vote guess of its usual waker.
+ * Sync wakeups, and wakeups from a waker that has held the vote for at
+ * least wake_affine_votes rounds, go to the waker's CPU or an idle CPU in
+ * its LLC, unless more than wake_flip_pct% of the task's recent wakeups
+ * came from someone else. wake_affine_votes = 0 disables.
+ */
+const volatile u32 wake_affine_votes = 4;
+const volatile u32 wake_flip_pct = 25;
+
+#define WAKER_VOTES_MAX	15
+#define WAKE_WINDOW	32
+
+#ifndef SCHED_EXT
+#define SCHED_EXT 7
+#endif
+
+#ifndef PF_EXITING
+#define PF_EXITING 0x00000004
+#endif
+
+/* Topology filled in by the loader: core and LLC ids per CPU */
+const volatile u32 cpu_core_id[MLFQ_MAX_CPUS];
+const volatile u32 cpu_llc_id[MLFQ_MAX_CPUS];
+
+/* Per-task state keyed by pid; see struct task_ctx */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(key_size, sizeof(u32));    /* pid */
+	__uint(value_size, sizeof(struct task_ctx));
+	__uint(max_entries, 65536);
+} task_level SEC(".maps");
+
+/* Lock-holder hints shared with mlfq_hint.c; pinned so clients can find them */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(struct slice_hint));
+	__uint(max_entries, MLFQ_HINT_SLOTS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} slice_hints SEC(".maps");
+
+/* HI admission bucket per parent tgid, kept as a theoretical arrival time */
+struct admit_bucket {
+	u64 tat;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(key_size, sizeof(u32));    /* parent tgid */
+	__uint(value_size, sizeof(struct admit_bucket));
+	__uint(max_entries, 4096);
+} admit_buckets SEC(".maps");
+
+/* Classification rules; see struct mlfq_rule */
+const volatile bool have_rules;
+
+/* Task whose level mlfq_exec changed while it ran on this CPU, 0 if none */
+u32 reslice_pid[MLFQ_MAX_CPUS];
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(struct mlfq_rule));
+	__uint(max_entries, MLFQ_MAX_RULES);
+} rules SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u64));
+	__uint(max_entries, MLFQ_MAX_RULES);
+} rule_hits SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(key_size, sizeof(u64));    /* cgroup v2 id */
+	__uint(value_size, sizeof(u32));  /* rule index */
+	__uint(max_entries, MLFQ_MAX_RULES);
+} rule_cgroup SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(key_size, sizeof(struct rule_comm_key));
+	__uint(value_size, sizeof(u32));
+	__uint(max_entries, MLFQ_MAX_RULES);
+} rule_comm SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(key_size, sizeof(struct rule_comm_key));
+	__uint(value_size, sizeof(u32));
+	__uint(max_entries, MLFQ_MAX_RULES);
+} rule_pcomm SEC(".maps");
+
+/* Per-application aggregates; see struct agg_stats */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(key_size, sizeof(u32));    /* tgid */
+	__uint(value_size, sizeof(struct agg_stats));
+	__uint(max_entries, MLFQ_AGG_ENTRIES);
+} tgid_stats SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(key_size, sizeof(struct comm_key));
+	__uint(value_size, sizeof(struct agg_stats));
+	__uint(max_entries, MLFQ_AGG_ENTRIES);
+} comm_stats SEC(".maps");
+
+/* Per-CPU placement state, read cross-CPU by the sticky enqueue path */
+struct cpu_ctx {
+	u64 busy_until;   /* expected end of the current slice, 0 if not running */
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(struct cpu_ctx));
+	__uint(max_entries, MLFQ_MAX_CPUS);
+} cpu_ctxs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u64));
+	__uint(max_entries, STAT_NR);
+} stats SEC(".maps");
+
+/* Gauges read by the loader straight from .bss, indexed by level */
+u64 dsq_depth[MLFQ_NR_LEVELS];
+s64 nr_tasks_level[MLFQ_NR_LEVELS];
+
+/* Written by the loader in partition mode */
+u8 cpu_interactive[MLFQ_MAX_CPUS];
+u32 partition_gen;		/* bumped by the loader after cpu_interactive changes */
+
+static __always_inline void stat_inc(u32 idx)
+{
+	u64 *cnt;
+
+	if (!enable_stats)
+		return;
+
+	cnt = bpf_map_lookup_elem(&stats, &idx);
+	if (cnt)
+		(*cnt)++;
+}
+
+static __always_inline void stat_add(u32 idx, u64 val)
+{
+	u64 *cnt;
+
+	if (!enable_stats)
+		return;
+
+	cnt = bpf_map_lookup_elem(&stats, &idx);
+	if (cnt)
+		(*cnt) += val;
+}
+
+static __always_inline u32 task_pid(struct task_struct *p)
+{
+	return (u32)BPF_CORE_READ(p, pid);
+}
+
+/*
+ * Every enabled task has an entry, so a miss means task_level evicted it:
+ * the table is too small for the number of tasks on the system.
+ */
+static __always_inline struct task_ctx *lookup_task_ctx(struct task_struct *p)
+{
+	u32 pid = task_pid(p);
+	struct task_ctx *tctx = bpf_map_lookup_elem(&task_level, &pid);
+
+	if (!tctx)
+		stat_inc(STAT_CTX_MISS);
+	return tctx;
+}
+
+static __always_inline struct cpu_ctx *lookup_cpu_ctx(s32 cpu)
+{
+	u32 idx = cpu;
+	return bpf_map_lookup_elem(&cpu_ctxs, &idx);
+}
+
+static __always_inline u8 get_level(struct task_struct *p)
+{
+	struct task_ctx *tctx = lookup_task_ctx(p);
+	return tctx ? tctx->level : 0; /* default HI */
+}
+
+static __always_inline void del_level(struct task_struct *p)
+{
+	u32 pid = task_pid(p);
+	bpf_map_delete_elem(&task_level, &pid);
+}
+
+static __always_inline bool is_interactive(s32 cpu)
+{
+	return partition_mode && cpu >= 0 && cpu < MLFQ_MAX_CPUS &&
+	       cpu_interactive[cpu];
+}
+
+/*
+ * Idle search masks for wake affinity and batch kicks, built in mlfq_init:
+ * the CPUs of each LLC (indexed by its id, the LLC's first CPU), a per-CPU
+ * scratch mask and, in partition mode, the batch CPUs, rebuilt when
+ * partition_gen moves.
+ */
+struct mask_ctx {
+	struct bpf_cpumask __kptr *mask;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct mask_ctx);
+	__uint(max_entries, MLFQ_MAX_CPUS);
+} llc_masks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct mask_ctx);
+	__uint(max_entries, 1);
+} wake_scratch SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct mask_ctx);
+	__uint(max_entries, 1);
+} batch_mask SEC(".maps");
+
+static u32 batch_mask_gen;
+
+static s32 mask_ctx_init(struct mask_ctx *mctx)
+{
+	struct bpf_cpumask *mask = bpf_cpumask_create();
+
+	if (!mask)
+		return -ENOMEM;
+	mask = bpf_kptr_xchg(&mctx->mask, mask);
+	if (mask)
+		bpf_cpumask_release(mask);
+	return 0;
+}
+
+static s32 wake_masks_init(void)
+{
+	u32 cpu, llc, zero = 0, nr_cpus = scx_bpf_nr_cpu_ids();
+	struct bpf_cpumask *mask;
+	struct mask_ctx *mctx;
+	s32 ret;
+
+	mctx = bpf_map_lookup_elem(&batch_mask, &zero);
+	if (!mctx)
+		return -ENOENT;
+	ret = mask_ctx_init(mctx);
+	if (ret)
+		return ret;
+
+	bpf_for(cpu, 0, MLFQ_MAX_CPUS) {
+		if (cpu >= nr_cpus)
+			break;
+
+		mctx = bpf_map_lookup_percpu_elem(&wake_scratch, &zero, cpu);
+		if (!mctx)
+			return -ENOENT;
+		ret = mask_ctx_init(mctx);
+		if (ret)
+			return ret;
+
+		/* an LLC's id is its first CPU, which comes first here */
+		llc = cpu_llc_id[cpu];
+		mctx = bpf_map_lookup_elem(&llc_masks, &llc);
+		if (!mctx)
+			return -ENOENT;
+		if (llc == cpu) {
+			ret = mask_ctx_init(mctx);
+			if (ret)
+				return ret;
+		}
+
+		bpf_rcu_read_lock();
+		mask = mctx->mask;
+		if (mask)
+			bpf_cpumask_set_cpu(cpu, mask);
+		bpf_rcu_read_unlock();
+	}
+	return 0;
+}
+
+/* Follow the loader's latest cpu_interactive update; O(nr_cpus) per resize */
+static __always_inline void refresh_batch_mask(struct bpf_cpumask *batch)
+{
+	u32 cpu, gen = partition_gen, nr_cpus = scx_bpf_nr_cpu_ids();
+
+	if (gen == batch_mask_gen)
+		return;
+
+	bpf_for(cpu, 0, MLFQ_MAX_CPUS) {
+		if (cpu >= nr_cpus)
+			break;
+		if (cpu_interactive[cpu])
+			bpf_cpumask_clear_cpu(cpu, batch);
+		else
+			bpf_cpumask_set_cpu(cpu, batch);
+	}
+	batch_mask_gen = gen;
+}
+
+/* Wake an idle batch CPU for a LO task queued while an interactive CPU was its target */
+static __always_inline void kick_batch_cpu(struct task_struct *p)
+{
+	struct mask_ctx *scratch, *batch_ctx;
+	struct bpf_cpumask *tmp, *batch;
+	u32 zero = 0;
+	s32 cpu;
+
+	scratch = bpf_map_lookup_elem(&wake_scratch, &zero);
+	batch_ctx = bpf_map_lookup_elem(&batch_mask, &zero);
+	if (!scratch || !batch_ctx)
+		return;
+	tmp = scratch->mask;
+	batch = batch_ctx->mask;
+	if (!tmp || !batch)
+		return;
+
+	refresh_batch_mask(batch);
+	bpf_cpumask_and(tmp, p->cpus_ptr, (const struct cpumask *)batch);
+
+	cpu = scx_bpf_pick_idle_cpu((const struct cpumask *)tmp, 0);
+	if (cpu >= 0)
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+}
+
+static __always_inline u32 migration_kind(s32 from, s32 to)
+{
+	if (from < 0 || from >= MLFQ_MAX_CPUS || to < 0 || to >= MLFQ_MAX_CPUS)
+		return MIG_CROSS_LLC;
+
+	if (cpu_core_id[from] == cpu_core_id[to])
+		return MIG_SAME_CORE;
+	if (cpu_llc_id[from] == cpu_llc_id[to])
+		return MIG_SAME_LLC;
+	return MIG_CROSS_LLC;
+}
+
+static __always_inline void account_migration(struct task_ctx *tctx, s32 cpu)
+{
+	u32 kind;
+
+	if (!enable_task_acct)
+		return;
+
+	if (tctx->last_cpu < 0 || tctx->last_cpu == cpu)
+		return;
+
+	kind = migration_kind(tctx->last_cpu, cpu);
+	if (kind >= MIG_NR)
+		return;
+
+	tctx->nr_migrations[kind]++;
+	stat_inc(STAT_MIG_SAME_CORE + kind);
+}
+
+/* This CPU's copy of the aggregate for @key, created on first use */
+static __always_inline struct agg_stats *agg_lookup(void *map, const void *key)
+{
+	struct agg_stats zero = {}, *agg;
+
+	agg = bpf_map_lookup_elem(map, key);
+	if (agg)
+		return agg;
+
+	bpf_map_update_elem(map, key, &zero, BPF_NOEXIST);
+	return bpf_map_lookup_elem(map, key);
+}
+
+static __always_inline void agg_add(struct agg_stats *agg,
+				    struct task_ctx *tctx, bool demoted)
+{
+	agg->runtime_ns += tctx->last_burst_ns;
+	agg->wait_ns += tctx->agg_wait_ns;
+	agg->nr_switches++;
+	agg->nr_demotions += demoted;
+}
+
+/*
+ * Fold the run that just ended into the task's tgid and comm aggregates.
+ * Callers test enable_agg first: without -g the maps are not created.
+ */
+static __always_inline void account_agg(struct task_struct *p,
+					struct task_ctx *tctx, bool demoted)
+{
+	u32 tgid = BPF_CORE_READ(p, tgid);
+	struct comm_key ck = {};
+	struct agg_stats *agg;
+
+	agg = agg_lookup(&tgid_stats, &tgid);
+	if (agg)
+		agg_add(agg, tctx, demoted);
+
+	bpf_probe_read_kernel_str(ck.comm, sizeof(ck.comm), p->comm);
+	agg = agg_lookup(&comm_stats, &ck);
+	if (agg)
+		agg_add(agg, tctx, demoted);
+
+	tctx->agg_wait_ns = 0;
+}
+
+/* Decay recent_run_ns by half per elapsed window, then add @run_ns */
+static __always_inline void account_usage(struct task_ctx *tctx, u64 now, u64 run_ns)
+{
+	u64 windows;
+
+	if (!enable_task_acct)
+		return;
+
+	if (usage_window_ns) {
+		windows = (now - tctx->usage_stamp_ns) / usage_window_ns;
+		if (windows) {
+			tctx->recent_run_ns = windows < 64 ? tctx->recent_run_ns >> windows : 0;
+			tctx->usage_stamp_ns = now;
+		}
+	}
+	tctx->recent_run_ns += run_ns;
+}
+
+/*
+ * A task running flat out converges to recent_run_ns == 2 * usage_window_ns,
+ * so the busy percentage is measured against that.
+ */
+static __always_inline bool usage_busy(struct task_ctx *tctx)
+{
+	return tctx->recent_run_ns * 100 >
+	       (u64)inherit_busy_pct * 2 * usage_window_ns;
+}
+
+/* Token bucket (GCRA form): one HI admission per 1/admit_rate seconds */
+static __always_inline bool admit_hi(u32 tgid, u64 now)
+{
+	struct admit_bucket *b, nb = {};
+	u64 interval;
+
+	if (!admit_rate)
+		return true;
+
+	interval = 1000000000ULL / admit_rate;
+
+	b = bpf_map_lookup_elem(&admit_buckets, &tgid);
+	if (!b) {
+		nb.tat = now + interval;
+		bpf_map_update_elem(&admit_buckets, &tgid, &nb, BPF_NOEXIST);
+		return true;
+	}
+
+	/* Racing CPUs may both admit on the last token; an extra HI task is fine */
+	if (b->tat < now)
+		b->tat = now;
+	if (b->tat - now >= (u64)admit_burst * interval)
+		return false;
+
+	b->tat += interval;
+	return true;
+}
+
+/*
+ * Pick the starting level of a task joining the scheduler from its parent:
+ * the forking task for processes, the group leader for threads.
+ */
+static __always_inline u8 initial_level(struct task_struct *p, u64 now)
+{
+	struct task_struct *parent;
+	struct task_ctx *pctx;
+	u32 ppid, ptgid;
+
+	if (BPF_CORE_READ(p, tgid) != BPF_CORE_READ(p, pid))
+		parent = BPF_CORE_READ(p, group_leader);
+	else
+		parent = BPF_CORE_READ(p, real_parent);
+
+	ppid = BPF_CORE_READ(parent, pid);
+	ptgid = BPF_CORE_READ(parent, tgid);
+
+	pctx = bpf_map_lookup_elem(&task_level, &ppid);
+	if (pctx) {
+		stat_inc(STAT_INHERIT);
+		if (pctx->level != 0 || usage_busy(pctx)) {
+			stat_inc(STAT_INHERIT_LO);
+			return 1;
+		}
+	}
+
+	if (!admit_hi(ptgid, now)) {
+		stat_inc(STAT_ADMIT_REJECT);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Queue a LO task straight onto its previous CPU's local DSQ while its
+ * cache footprint is still warm. Returns false when the task should go
+ * through DSQ_LO instead.
+ */
+static __always_inline bool try_sticky_lo(struct task_struct *p,
+					  struct task_ctx *tctx, u64 enq_flags)
+{
+	struct cpu_ctx *cctx;
+	s32 cpu = tctx->last_cpu;
+	u64 now;
+
+	if (!cache_hot_ns || cpu < 0 || cpu >= MLFQ_MAX_CPUS)
+		return false;
+
+	if (is_interactive(cpu))
+		return false;
+
+	if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr))
+		return false;
+
+	/*
+	 * The local DSQ is served before DSQ_HI and the task runs with
+	 * SCX_SLICE_INF, so sticking now would put it ahead of queued HI work.
+	 */
+	if (scx_bpf_dsq_nr_queued(DSQ_HI) ||
+	    scx_bpf_dsq_nr_queued(DSQ_PCPU(cpu, 0)))
+		return false;
+
+	now = bpf_ktime_get_ns();
+	if (now - tctx->last_ran_ns > cache_hot_ns)
+		return false;
+
+	cctx = lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return false;
+
+	/* Busy CPU: only wait for it if it frees up within the migration cost */
+	if (!scx_bpf_test_and_clear_cpu_idle(cpu) &&
+	    (scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu) ||
+	     cctx->busy_until > now + migration_cost_ns)) {
+		stat_inc(STAT_STICKY_MISS);
+		return false;
+	}
+
+	stat_inc(STAT_STICKY);
+	scx_bpf_dispatch(p, SCX_DSQ_LOCAL_ON | cpu, SCX_SLICE_INF, enq_flags);
+	scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+	return true;
+}
+
+/*
+ * HI slice (HI_SLICE_NS or the task's rule override) minus any extension
+ * time still owed, which is settled here
+ */
+static __always_inline u64 hi_slice(struct task_ctx *tctx)
+{
+	u64 slice, debt;
+
+	if (!tctx)
+		return HI_SLICE_NS;
+
+	slice = tctx->hi_slice_ns ?: HI_SLICE_NS;
+	if (!tctx->ext_debt_ns)
+		return slice;
+
+	debt = tctx->ext_debt_ns;
+	if (debt > slice / 2)
+		debt = slice / 2;
+	tctx->ext_debt_ns = 0;
+	stat_add(STAT_EXT_DEBT_NS, debt);
+	return slice - debt;
+}
+
+/* The hint of a registered thread, or NULL; see MLFQ_HINT_PROBE */
+static __always_inline struct slice_hint *lookup_hint(u32 pid)
+{
+	struct slice_hint *hint;
+	u32 i, idx;
+
+	if (!pid)
+		return NULL;
+
+	bpf_for(i, 0, MLFQ_HINT_PROBE) {
+		idx = (pid + i) % MLFQ_HINT_SLOTS;
+		hint = bpf_map_lookup_elem(&slice_hints, &idx);
+		if (hint && hint->tid == pid)
+			return hint;
+	}
+	return NULL;
+}
+
+/* Free the hint slot of an exiting thread that did not unregister */
+static __always_inline void release_hint(u32 pid)
+{
+	struct slice_hint *hint = lookup_hint(pid);
+
+	if (!hint)
+		return;
+
+	hint->in_cs = 0;
+	hint->tid = 0;
+}
+
+/*
+ * A task that can only run on one CPU is queued on that CPU's DSQ for its
+ * level, so other CPUs never scan past it in DSQ_HI/DSQ_LO.
+ */
+static __always_inline bool enqueue_pinned(struct task_struct *p,
+					   struct task_ctx *tctx, u64 enq_flags)
+{
+	u32 cpu = bpf_cpumask_first(p->cpus_ptr);
+	u8 level = tctx ? tctx->level : 0;
+
+	if (cpu >= MLFQ_MAX_CPUS || level >= MLFQ_NR_LEVELS)
+		return false;
+
+	stat_inc(level == 0 ? STAT_ENQ_HI : STAT_ENQ_LO);
+	stat_inc(STAT_PINNED);
+	scx_bpf_dispatch(p, DSQ_PCPU(cpu, level),
+			 level == 0 ? hi_slice(tctx) : SCX_SLICE_INF, enq_flags);
+	scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+	return true;
+}
+
+/*
+ * This CPU's pinned tasks first, then, if @shared, the shared DSQ of the
+ * same level. STAT_CONS_HI/LO only count tasks taken from the shared DSQs.
+ */
+static __always_inline bool consume_level(s32 cpu, u8 level, bool shared)
+{
+	if (cpu >= 0 && cpu < MLFQ_MAX_CPUS &&
+	    scx_bpf_consume(DSQ_PCPU(cpu, level))) {
+		stat_inc(STAT_CONS_PCPU);
+		return true;
+	}
+	if (!shared || !scx_bpf_consume(level == 0 ? DSQ_HI : DSQ_LO))
+		return false;
+	stat_inc(level == 0 ? STAT_CONS_HI : STAT_CONS_LO);
+	return true;
+}
+
+/*
+ * ---- shared per-task table (MLFQ_ARENA builds only) ----
+ * Records live in an arena allocated once in mlfq_init; free slots are kept
+ * in a queue map and returned in mlfq_disable (a task_level entry lost to
+ * LRU eviction keeps its slot). Every update is bracketed by two gen
+ * increments, see struct task_rec.
+ */
+#ifdef MLFQ_ARENA
+#ifndef __arena
+#define __arena __attribute__((address_space(1)))
+#endif
+
+void __arena *bpf_arena_alloc_pages(void *map, void __arena *addr, __u32 page_cnt,
+				    int node_id, __u64 flags) __ksym __weak;
+
+#define ARENA_PAGES ((MLFQ_ARENA_SLOTS * sizeof(struct task_rec) + 4095) / 4096)
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARENA);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(max_entries, ARENA_PAGES);
+} arena SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_QUEUE);
+	__uint(value_size, sizeof(u32));
+	__uint(max_entries, MLFQ_ARENA_SLOTS);
+} rec_free SEC(".maps");
+
+/* Read by the loader through its own mapping of the arena */
+struct task_rec __arena *task_recs;
+
+static __always_inline struct task_rec __arena *task_rec_of(struct task_ctx *tctx)
+{
+	u32 slot = tctx->rec_slot - 1;
+
+	if (!tctx->rec_slot || slot >= MLFQ_ARENA_SLOTS || !task_recs)
+		return NULL;
+	return &task_recs[slot];
+}
+
+#define REC_UPDATE(rec, body)						\
+	do {								\
+		(rec)->gen++;						\
+		barrier();						\
+		body;							\
+		barrier();						\
+		(rec)->gen++;						\
+	} while (0)
+
+static __always_inline void rec_open(struct task_ctx *tctx, u32 pid)
+{
+	struct task_rec __arena *rec;
+	u32 slot;
+
+	if (bpf_map_pop_elem(&rec_free, &slot) || slot >= MLFQ_ARENA_SLOTS)
+		return;
+
+	tctx->rec_slot = slot + 1;
+	rec = task_rec_of(tctx);
+	if (!rec)
+		return;
+
+	REC_UPDATE(rec, {
+		rec->pid = pid;
+		rec->level = tctx->level;
+		rec->last_cpu = -1;
+		rec->runtime_ns = 0;
+		rec->wait_ns = 0;
+		rec->nr_switches = 0;
+	});
+}
+
+static __always_inline void rec_close(struct task_ctx *tctx)
+{
+	struct task_rec __arena *rec = task_rec_of(tctx);
+	u32 slot = tctx->rec_slot - 1;
+
+	if (!rec)
+		return;
+
+	REC_UPDATE(rec, rec->pid = 0);
+	tctx->rec_slot = 0;
+	bpf_map_push_elem(&rec_free, &slot, 0);
+}
+
+static __always_inline void rec_running(struct task_ctx *tctx, s32 cpu, u64 wait_ns)
+{
+	struct task_rec __arena *rec = task_rec_of(tctx);
+
+	if (!rec)
+		return;
+
+	REC_UPDATE(rec, {
+		rec->last_cpu = cpu;
+		rec->wait_ns += wait_ns;
+		rec->nr_switches++;
+	});
+}
+
+static __always_inline void rec_stopping(struct task_ctx *tctx)
+{
+	struct task_rec __arena *rec = task_rec_of(tctx);
+
+	if (!rec)
+		return;
+
+	REC_UPDATE(rec, rec->runtime_ns += tctx->last_burst_ns);
+}
+
+static __always_inline void rec_level(struct task_ctx *tctx)
+{
+	struct task_rec __arena *rec = task_rec_of(tctx);
+
+	if (!rec)
+		return;
+
+	REC_UPDATE(rec, rec->level = tctx->level);
+}
+
+static s32 arena_init(void)
+{
+	u32 slot;
+
+	task_recs = bpf_arena_alloc_pages(&arena, NULL, ARENA_PAGES, NUMA_NO_NODE, 0);
+	if (!task_recs)
+		return -ENOMEM;
+
+	bpf_for(slot, 0, MLFQ_ARENA_SLOTS) {
+		if (bpf_map_push_elem(&rec_free, &slot, 0))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+#define ENQ_TIMESTAMPS true
+#else
+#define rec_open(tctx, pid)		do {} while (0)
+#define rec_close(tctx)			do {} while (0)
+#define rec_running(tctx, cpu, wait_ns)	do {} while (0)
+#define rec_stopping(tctx)		do {} while (0)
+#define rec_level(tctx)			do {} while (0)
+#define ENQ_TIMESTAMPS (enable_stats || enable_agg)
+#endif
 
-/* Per-task level: 0 => HI, 1 => LO */
+/*
+ * ---- user-space-assisted mode ----
+ * Ring buffer sizes must be page-aligned powers of two. Each record also
+ * carries an 8-byte header: 512KB holds MLFQ_USER_QUEUE_LEN of either
+ * record with room to spare. Without -u the loader skips creating both.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__uint(key_size, sizeof(u32));    /* pid */
-	__uint(value_size, sizeof(u8));   /* level */
-	__uint(max_entries, 65536);
-} task_level SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 1 << 19);
+} user_tasks SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_USER_RINGBUF);
+	__uint(max_entries, 1 << 19);
+} user_decisions SEC(".maps");
 
-/* Minimal stats */
-enum {
-	STAT_ENQ_HI = 0,
-	STAT_ENQ_LO = 1,
-	STAT_CONS_HI = 2,
-	STAT_CONS_LO = 3,
-	STAT_DEMOTE = 4,
-	STAT_NR,
+/* Hand-off order, used to find tasks whose decision timed out */
+struct user_pending_ent {
+	u64 enq_ns;
+	u32 pid;
+	u32 seq;
 };
 
 struct {
-	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
-	__uint(key_size, sizeof(u32));
-	__uint(value_size, sizeof(u64));
-	__uint(max_entries, STAT_NR);
-} stats SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_QUEUE);
+	__uint(value_size, sizeof(struct user_pending_ent));
+	__uint(max_entries, MLFQ_USER_QUEUE_LEN);
+} user_pending SEC(".maps");
 
-static __always_inline void stat_inc(u32 idx)
+/* Periodic kick so idle CPUs pick up decisions and timed-out tasks */
+struct user_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct user_timer);
+} user_timers SEC(".maps");
+
+struct user_drain_ctx {
+	u32 nr;
+	struct user_decision d[MLFQ_USER_DRAIN_BATCH];
+};
+
+static __always_inline u64 level_slice(u8 level)
 {
-	u64 *cnt = bpf_map_lookup_elem(&stats, &idx);
-	if (cnt)
-		(*cnt)++;
+	return level == 0 ? HI_SLICE_NS : SCX_SLICE_INF;
 }
 
-static __always_inline u32 task_pid(struct task_struct *p)
+/* Returns true if the task now waits for the policy thread */
+static __always_inline bool user_enqueue(struct task_struct *p, struct task_ctx *tctx)
 {
-	return (u32)BPF_CORE_READ(p, pid);
+	struct user_pending_ent ent;
+	struct user_task *ut;
+
+	ut = bpf_ringbuf_reserve(&user_tasks, sizeof(*ut), 0);
+	if (!ut) {
+		stat_inc(STAT_USER_FULL);
+		return false;
+	}
+
+	ent.enq_ns = bpf_ktime_get_ns();
+	ent.pid = task_pid(p);
+	ent.seq = ++tctx->user_seq;
+
+	if (bpf_map_push_elem(&user_pending, &ent, 0)) {
+		bpf_ringbuf_discard(ut, 0);
+		stat_inc(STAT_USER_FULL);
+		return false;
+	}
+
+	tctx->user_pending = 1;
+
+	ut->enq_ns = ent.enq_ns;
+	ut->last_burst_ns = tctx->last_burst_ns;
+	ut->pid = ent.pid;
+	ut->seq = ent.seq;
+	ut->level = tctx->level;
+	bpf_ringbuf_submit(ut, 0);
+
+	stat_inc(STAT_USER_ENQ);
+	return true;
 }
 
-static __always_inline u8 get_level(struct task_struct *p)
+static long user_decision_cb(struct bpf_dynptr *dynptr, void *ctx)
 {
-	u32 pid = task_pid(p);
-	u8 *lvl = bpf_map_lookup_elem(&task_level, &pid);
-	return lvl ? *lvl : 0; /* default HI */
+	struct user_drain_ctx *dctx = ctx;
+	u32 idx = dctx->nr;
+
+	if (idx >= MLFQ_USER_DRAIN_BATCH)
+		return 1;
+
+	if (bpf_dynptr_read(&dctx->d[idx], sizeof(dctx->d[idx]), dynptr, 0, 0))
+		return 0;
+
+	dctx->nr = idx + 1;
+	return dctx->nr >= MLFQ_USER_DRAIN_BATCH;
 }
 
-static __always_inline void set_level(struct task_struct *p, u8 lvl)
+/* Claim @p for dispatch if it is still waiting on hand-off @seq */
+static __always_inline struct task_ctx *user_claim(struct task_struct *p, u32 seq)
 {
-	u32 pid = task_pid(p);
-	bpf_map_update_elem(&task_level, &pid, &lvl, BPF_ANY);
+	struct task_ctx *tctx = lookup_task_ctx(p);
+
+	if (!tctx || !tctx->user_pending || tctx->user_seq != seq)
+		return NULL;
+
+	tctx->user_pending = 0;
+	return tctx;
 }
 
-static __always_inline void del_level(struct task_struct *p)
+/* Apply queued policy decisions, then rescue hand-offs that timed out */
+static __always_inline void user_dispatch(void)
 {
-	u32 pid = task_pid(p);
-	bpf_map_delete_elem(&task_level, &pid);
+	struct user_drain_ctx dctx = {};
+	struct user_pending_ent ent;
+	u64 now = bpf_ktime_get_ns();
+	u32 i;
+
+	bpf_user_ringbuf_drain(&user_decisions, user_decision_cb, &dctx, 0);
+
+	bpf_for(i, 0, MLFQ_USER_DRAIN_BATCH) {
+		struct user_decision *d;
+		struct task_struct *p;
+		struct task_ctx *tctx;
+
+		if (i >= dctx.nr)
+			break;
+		d = &dctx.d[i];
+
+		p = bpf_task_from_pid(d->pid);
+		if (!p) {
+			stat_inc(STAT_USER_STALE);
+			continue;
+		}
+
+		tctx = user_claim(p, d->seq);
+		if (tctx) {
+			scx_bpf_dispatch(p, DSQ_USER,
+					 d->slice_ns ?: level_slice(tctx->level), 0);
+			stat_inc(STAT_USER_DISPATCH);
+			stat_add(STAT_USER_RTT_NS, now - d->enq_ns);
+		} else {
+			stat_inc(STAT_USER_STALE);
+		}
+		bpf_task_release(p);
+	}
+
+	bpf_for(i, 0, MLFQ_USER_DRAIN_BATCH) {
+		struct task_struct *p;
+		struct task_ctx *tctx;
+
+		if (bpf_map_peek_elem(&user_pending, &ent))
+			break;
+
+		p = bpf_task_from_pid(ent.pid);
+		tctx = p ? lookup_task_ctx(p) : NULL;
+
+		/* Oldest hand-off still within its deadline: nothing to rescue */
+		if (tctx && tctx->user_pending && tctx->user_seq == ent.seq &&
+		    now - ent.enq_ns < user_timeout_ns) {
+			bpf_task_release(p);
+			break;
+		}
+		if (p)
+			bpf_task_release(p);
+
+		/* Another CPU may have popped first; act on what we got */
+		if (bpf_map_pop_elem(&user_pending, &ent))
+			break;
+
+		p = bpf_task_from_pid(ent.pid);
+		if (!p)
+			continue;
+
+		tctx = user_claim(p, ent.seq);
+		if (tctx) {
+			scx_bpf_dispatch(p, tctx->level == 0 ? DSQ_HI : DSQ_LO,
+					 level_slice(tctx->level), 0);
+			stat_inc(STAT_USER_FALLBACK);
+		}
+		bpf_task_release(p);
+	}
 }
 
-/* ---- log events via ringbuf (NO timeline, NO comm) ---- */
-enum ev_type {
-	EV_DEMOTE  = 1,
-	EV_DONE_LO = 2,
-};
+static int user_timer_fn(void *map, int *key, struct bpf_timer *timer)
+{
+	struct user_pending_ent ent;
+	struct task_struct *p;
+	s32 cpu;
 
-struct ev {
-	u64 ts_ns;
-	u32 cpu;
-	u32 pid;
-	u8  type;
-	u8  _pad[3];
-};
+	/* Wake an idle CPU the oldest waiting task may run on */
+	if (!bpf_map_peek_elem(&user_pending, &ent)) {
+		p = bpf_task_from_pid(ent.pid);
+		if (p) {
+			cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
+			if (cpu >= 0)
+				scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+			bpf_task_release(p);
+		}
+	}
+
+	bpf_timer_start(timer, user_tick_ns, 0);
+	return 0;
+}
+
+/*
+ * ---- self-overhead profiling (MLFQ_PROFILE builds only) ----
+ * Callbacks are timed with PROF_SCOPE(), see sched_prof.bpf.h. Without
+ * MLFQ_PROFILE the macro is empty and the prof map does not exist.
+ */
+#ifdef MLFQ_PROFILE
+#include "sched_prof.bpf.h"
+#else
+#define PROF_SCOPE(id)
+#endif
 
+/* ---- log events via ringbuf (struct ev lives in scx_mlfq.h) ---- */
 struct {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
 	__uint(max_entries, 1 << 20); /* 1MB */
 } events SEC(".maps");
 
-static __always_inline void emit_event(struct task_struct *p, u8 type)
+static __always_inline void emit_event(struct task_struct *p, u8 type, u8 level,
+				       bool runnable)
 {
 	struct ev *e;
-	u32 cpu = bpf_get_smp_processor_id();
+	u32 cpu, pid;
 
-	if (cpu != TRACE_CPU)
+	if (!enable_events)
 		return;
 
+	/* Timeline events cost nothing unless tracing was asked for */
+	if (type > EV_DONE_LO && !trace_all)
+		return;
+
+	cpu = bpf_get_smp_processor_id();
+	pid = task_pid(p);
+
+	if (!trace_all) {
+		if (cpu != TRACE_CPU)
+			return;
+	} else {
+		if (pid & ((1U << trace_sample_shift) - 1))
+			return;
+
+		if (bpf_ringbuf_query(&events, BPF_RB_AVAIL_DATA) > trace_max_backlog) {
+			stat_inc(STAT_EV_DROP);
+			return;
+		}
+	}
+
 	e = bpf_ringbuf_reserve(&events, sizeof(*e), 0);
-	if (!e)
+	if (!e) {
+		stat_inc(STAT_EV_DROP);
 		return;
+	}
+
+	e->ts_ns    = bpf_ktime_get_ns();
+	e->cpu      = cpu;
+	e->pid      = pid;
+	e->type     = type;
+	e->level    = level;
+	e->runnable = runnable;
+	e->_pad     = 0;
+
+	/* The loader polls on a timer while tracing; skip the wakeup IPI */
+	bpf_ringbuf_submit(e, trace_all ? BPF_RB_NO_WAKEUP : 0);
+}
+
+/* Boyer-Moore majority vote over the task's wakers */
+static __always_inline void track_waker(struct task_ctx *tctx, u32 waker)
+{
+	if (tctx->waker_pid == waker) {
+		if (tctx->waker_votes < WAKER_VOTES_MAX)
+			tctx->waker_votes++;
+	} else {
+		tctx->waker_flips++;
+		if (tctx->waker_votes) {
+			tctx->waker_votes--;
+		} else {
+			tctx->waker_pid = waker;
+			tctx->waker_votes = 1;
+		}
+	}
+
+	/* halve the window so the flip rate follows recent behaviour */
+	if (++tctx->wakeups >= WAKE_WINDOW) {
+		tctx->wakeups /= 2;
+		tctx->waker_flips /= 2;
+	}
+}
+
+/* Claim an idle CPU of @llc that affine_ok() would accept, or -1 */
+static __always_inline s32 pick_idle_llc_cpu(struct task_struct *p,
+					     struct task_ctx *tctx, u32 llc)
+{
+	struct mask_ctx *scratch, *llc_ctx, *batch_ctx;
+	struct bpf_cpumask *tmp, *llc_mask, *batch;
+	u32 zero = 0;
 
-	e->ts_ns = bpf_ktime_get_ns();
-	e->cpu   = cpu;
-	e->pid   = task_pid(p);
-	e->type  = type;
+	scratch = bpf_map_lookup_elem(&wake_scratch, &zero);
+	llc_ctx = bpf_map_lookup_elem(&llc_masks, &llc);
+	if (!scratch || !llc_ctx)
+		return -1;
+	tmp = scratch->mask;
+	llc_mask = llc_ctx->mask;
+	if (!tmp || !llc_mask)
+		return -1;
 
-	bpf_ringbuf_submit(e, 0);
+	bpf_cpumask_and(tmp, p->cpus_ptr, (const struct cpumask *)llc_mask);
+
+	if (tctx->level && partition_mode) {
+		batch_ctx = bpf_map_lookup_elem(&batch_mask, &zero);
+		batch = batch_ctx ? batch_ctx->mask : NULL;
+		if (!batch)
+			return -1;
+		refresh_batch_mask(batch);
+		bpf_cpumask_and(tmp, (const struct cpumask *)tmp,
+				(const struct cpumask *)batch);
+	}
+
+	return scx_bpf_pick_idle_cpu((const struct cpumask *)tmp, 0);
+}
+
+/* LO tasks stay off interactive CPUs, as in mlfq_enqueue */
+static __always_inline bool affine_ok(struct task_struct *p,
+				      struct task_ctx *tctx, s32 cpu)
+{
+	return bpf_cpumask_test_cpu(cpu, p->cpus_ptr) &&
+	       !(tctx->level && is_interactive(cpu));
+}
+
+/*
+ * CPU near the waker for @p, or -1 to fall back to the default pick.
+ * *@direct is set when @p should run next on the waker's own CPU.
+ */
+static __always_inline s32 pick_affine_cpu(struct task_struct *p,
+					   struct task_ctx *tctx, s32 prev_cpu,
+					   u64 wake_flags, bool *direct)
+{
+	struct task_struct *cur = bpf_get_current_task_btf();
+	u32 waker = task_pid(cur);
+	u32 cpu = bpf_get_smp_processor_id();
+	bool sync;
+	s32 idle;
+	u32 llc;
+
+	/*
+	 * The idle task is no waker. Wakeups from interrupts are not told
+	 * apart: they count for whichever task was interrupted, and the vote
+	 * and flip filters below keep that noise from steering placement.
+	 */
+	if (!waker || cpu >= MLFQ_MAX_CPUS)
+		return -1;
+
+	track_waker(tctx, waker);
+
+	/* a fair-class waker would keep a wakee queued behind it indefinitely */
+	sync = (wake_flags & SCX_WAKE_SYNC) && cur->policy == SCHED_EXT;
+
+	if (tctx->waker_flips * 100 > wake_flip_pct * tctx->wakeups) {
+		stat_inc(STAT_WAKE_FLIPPY);
+		return -1;
+	}
+	if (!sync && tctx->waker_votes < wake_affine_votes)
+		return -1;
+
+	llc = cpu_llc_id[cpu];
+
+	/* the wakee's own CPU is the warmest choice if it shares the LLC */
+	if (prev_cpu >= 0 && prev_cpu < MLFQ_MAX_CPUS &&
+	    cpu_llc_id[prev_cpu] == llc && affine_ok(p, tctx, prev_cpu) &&
+	    scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+		stat_inc(STAT_WAKE_LLC);
+		return prev_cpu;
+	}
+
+	/*
+	 * A sync waker is about to block: run next on its CPU if nothing waits
+	 * there. Queued HI work would be overtaken by the local dispatch.
+	 */
+	if (sync && !tctx->level && !user_mode && affine_ok(p, tctx, cpu) &&
+	    !scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu) &&
+	    !scx_bpf_dsq_nr_queued(DSQ_HI) &&
+	    !scx_bpf_dsq_nr_queued(DSQ_PCPU(cpu, 0))) {
+		stat_inc(STAT_WAKE_SYNC);
+		*direct = true;
+		return cpu;
+	}
+
+	idle = pick_idle_llc_cpu(p, tctx, llc);
+	if (idle >= 0)
+		stat_inc(STAT_WAKE_LLC);
+	return idle;
 }
 
-/* Keep CPU selection default; no queue-bypass fastpaths. */
+/*
+ * Producer/consumer pairs are kept next to each other (see pick_affine_cpu);
+ * everything else gets the default pick. The only queue bypass is a HI sync
+ * wakeup, which goes straight to the waker's local DSQ.
+ */
 s32 BPF_STRUCT_OPS(mlfq_select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
 {
-	bool is_idle = false;
+	PROF_SCOPE(PROF_SELECT_CPU);
+	struct task_ctx *tctx;
+	bool is_idle = false, direct = false;
+	s32 cpu;
+
+	if (wake_affine_votes && p->nr_cpus_allowed > 1 &&
+	    !(wake_flags & SCX_WAKE_FORK) && (tctx = lookup_task_ctx(p))) {
+		cpu = pick_affine_cpu(p, tctx, prev_cpu, wake_flags, &direct);
+		if (cpu >= 0) {
+			if (direct) {
+				emit_event(p, EV_ENQUEUE, 0, true);
+				if (ENQ_TIMESTAMPS)
+					tctx->enq_ns = bpf_ktime_get_ns();
+				stat_inc(STAT_ENQ_HI);
+				scx_bpf_dispatch(p, SCX_DSQ_LOCAL, hi_slice(tctx), 0);
+			}
+			return cpu;
+		}
+	}
+
 	return scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
 }
 
 void BPF_STRUCT_OPS(mlfq_enqueue, struct task_struct *p, u64 enq_flags)
 {
-	if (get_level(p) == 0) {
+	PROF_SCOPE(PROF_ENQUEUE);
+	struct task_ctx *tctx = lookup_task_ctx(p);
+
+	emit_event(p, EV_ENQUEUE, tctx ? tctx->level : 0, true);
+
+	if (ENQ_TIMESTAMPS && tctx)
+		tctx->enq_ns = bpf_ktime_get_ns();
+
+	if (p->nr_cpus_allowed == 1 && enqueue_pinned(p, tctx, enq_flags))
+		return;
+
+	if (user_mode && tctx && user_enqueue(p, tctx))
+		return;
+
+	if (!tctx || tctx->level == 0) {
 		stat_inc(STAT_ENQ_HI);
-		scx_bpf_dispatch(p, DSQ_HI, HI_SLICE_NS, enq_flags);
+		scx_bpf_dispatch(p, DSQ_HI, hi_slice(tctx), enq_flags);
 	} else {
 		stat_inc(STAT_ENQ_LO);
+		if (try_sticky_lo(p, tctx, enq_flags))
+			return;
 		scx_bpf_dispatch(p, DSQ_LO, SCX_SLICE_INF, enq_flags);
+		if (is_interactive(scx_bpf_task_cpu(p)))
+			kick_batch_cpu(p);
 	}
 }
 
+/*
+ * Move up to dispatch_batch HI tasks into the local DSQ so a CPU churning
+ * through short tasks does not re-enter dispatch once per task. Level order
+ * is kept: LO is only looked at when no HI task is left, and within a level
+ * this CPU's pinned tasks go before the shared DSQ.
+ */
 void BPF_STRUCT_OPS(mlfq_dispatch, s32 cpu, struct task_struct *prev)
 {
-	stat_inc(STAT_CONS_HI);
-	if (scx_bpf_consume(DSQ_HI))
-		return;
+	PROF_SCOPE(PROF_DISPATCH);
+	u32 i, nr = 0;
+
+	if (enable_stats) {
+		dsq_depth[0] = scx_bpf_dsq_nr_queued(DSQ_HI);
+		dsq_depth[1] = scx_bpf_dsq_nr_queued(DSQ_LO);
+	}
+
+	stat_inc(STAT_DISPATCH);
+
+	if (user_mode) {
+		user_dispatch();
+
+		bpf_for(i, 0, MLFQ_MAX_DISPATCH_BATCH) {
+			if (i >= dispatch_batch || !scx_bpf_dispatch_nr_slots())
+				break;
+			if (!scx_bpf_consume(DSQ_USER))
+				break;
+			nr++;
+		}
+		if (nr) {
+			stat_inc(STAT_DISPATCH_USEFUL);
+			return;
+		}
+	}
+
+	bpf_for(i, 0, MLFQ_MAX_DISPATCH_BATCH) {
+		if (i >= dispatch_batch || !scx_bpf_dispatch_nr_slots())
+			break;
+		if (!consume_level(cpu, 0, true))
+			break;
+		nr++;
+	}
+
+	/* Interactive CPUs leave shared LO work to the batch CPUs */
+	if (!nr && consume_level(cpu, 1, !is_interactive(cpu)))
+		nr++;
+
+	if (nr)
+		stat_inc(STAT_DISPATCH_USEFUL);
+}
+
+void BPF_STRUCT_OPS(mlfq_running, struct task_struct *p)
+{
+	PROF_SCOPE(PROF_RUNNING);
+	struct task_ctx *tctx = lookup_task_ctx(p);
+	s32 cpu = scx_bpf_task_cpu(p);
+	struct cpu_ctx *cctx;
+	u64 now = bpf_ktime_get_ns();
+
+	if (tctx) {
+		account_migration(tctx, cpu);
+		tctx->last_cpu = cpu;
+		tctx->run_start_ns = now;
+
+		if (tctx->enq_ns && tctx->level == 0) {
+			stat_inc(STAT_HI_WAITS);
+			stat_add(STAT_HI_WAIT_NS, now - tctx->enq_ns);
+		}
+		if (enable_agg && tctx->enq_ns)
+			tctx->agg_wait_ns += now - tctx->enq_ns;
+		rec_running(tctx, cpu, tctx->enq_ns ? now - tctx->enq_ns : 0);
+		tctx->enq_ns = 0;
+	}
+
+	emit_event(p, EV_RUNNING, tctx ? tctx->level : 0, true);
+
+	cctx = lookup_cpu_ctx(cpu);
+	if (cctx) {
+		u64 slice = p->scx.slice;
 
-	stat_inc(STAT_CONS_LO);
-	scx_bpf_consume(DSQ_LO);
+		cctx->busy_until = slice == SCX_SLICE_INF ? (u64)-1 : now + slice;
+	}
+}
+
+/* HI task that used up its slice, unless a rule keeps it in HI */
+static __always_inline bool should_demote(struct task_struct *p,
+					  struct task_ctx *tctx, bool runnable)
+{
+	return runnable && tctx->level == 0 && p->scx.slice == 0 &&
+	       tctx->demote != RULE_DEMOTE_NEVER;
 }
 
 /*
@@ -150,38 +1465,312 @@ void BPF_STRUCT_OPS(mlfq_dispatch, s32 cpu, struct task_struct *prev)
  */
 void BPF_STRUCT_OPS(mlfq_stopping, struct task_struct *p, bool runnable)
 {
+	PROF_SCOPE(PROF_STOPPING);
+	struct task_ctx *tctx = lookup_task_ctx(p);
+	struct cpu_ctx *cctx = lookup_cpu_ctx(scx_bpf_task_cpu(p));
+	bool demote = false;
+
+	if (cctx)
+		cctx->busy_until = 0;
+
+	if (tctx) {
+		demote = should_demote(p, tctx, runnable);
+
+		tctx->last_ran_ns = bpf_ktime_get_ns();
+		tctx->last_burst_ns = tctx->last_ran_ns - tctx->run_start_ns;
+		account_usage(tctx, tctx->last_ran_ns, tctx->last_burst_ns);
+		rec_stopping(tctx);
+
+		/* Charge the part of an extension that was actually used */
+		if (tctx->slice_ext) {
+			u64 used = slice_ext_ns - (p->scx.slice < slice_ext_ns ?
+						   p->scx.slice : slice_ext_ns);
+
+			tctx->ext_debt_ns += used;
+			stat_add(STAT_EXT_NS, used);
+			tctx->slice_ext = 0;
+			/* stay in HI so the debt shortens the next HI slice */
+			demote = false;
+		}
+
+		if (partition_mode)
+			stat_add(is_interactive(scx_bpf_task_cpu(p)) ?
+				 STAT_BUSY_INTERACTIVE_NS : STAT_BUSY_BATCH_NS,
+				 tctx->last_burst_ns);
+
+		if (enable_agg)
+			account_agg(p, tctx, demote);
+	}
+
+	emit_event(p, EV_STOPPING, tctx ? tctx->level : 0, runnable);
+
 	/* One-round RR then FIFO demotion */
 	if (!runnable)
 		return;
 
-	if (get_level(p) != 0)
+	if (!tctx)
 		return;
 
-	if (p->scx.slice == 0) {
-		set_level(p, 1);
+	if (demote) {
+		tctx->level = 1;
 		stat_inc(STAT_DEMOTE);
+		__sync_fetch_and_add(&nr_tasks_level[0], -1);
+		__sync_fetch_and_add(&nr_tasks_level[1], 1);
+		rec_level(tctx);
 
 		/* demote signal (same mechanism as before) */
-		emit_event(p, EV_DEMOTE);
+		emit_event(p, EV_DEMOTE, 1, true);
+	}
+}
+
+/* One extension per slice for a HI task that ran out inside a critical section */
+static __always_inline void try_extend_slice(struct task_struct *p)
+{
+	struct slice_hint *hint;
+	struct task_ctx *tctx;
+
+	hint = lookup_hint(task_pid(p));
+	if (!hint || !hint->in_cs)
+		return;
+
+	tctx = lookup_task_ctx(p);
+	if (!tctx || tctx->level != 0)
+		return;
+
+	if (tctx->slice_ext) {
+		stat_inc(STAT_EXT_DENY);
+		return;
 	}
+
+	tctx->slice_ext = 1;
+	p->scx.slice = slice_ext_ns;
+	stat_inc(STAT_EXT_GRANT);
+}
+
+/*
+ * Runs after the slice was charged for the tick and before the kernel
+ * preempts a task whose slice hit zero, so an extension granted here
+ * avoids the preemption.
+ *
+ * LO tasks run with SCX_SLICE_INF; once their CPU has been made interactive,
+ * end the slice so the task requeues and moves to a batch CPU.
+ */
+void BPF_STRUCT_OPS(mlfq_tick, struct task_struct *p)
+{
+	PROF_SCOPE(PROF_TICK);
+	u32 cpu = bpf_get_smp_processor_id();
+	struct task_ctx *tctx;
+
+	/* a tracing program cannot write p->scx.slice, so mlfq_exec asks here */
+	if (have_rules && cpu < MLFQ_MAX_CPUS && reslice_pid[cpu]) {
+		if (reslice_pid[cpu] == task_pid(p) && (tctx = lookup_task_ctx(p)))
+			p->scx.slice = tctx->level ? SCX_SLICE_INF : hi_slice(tctx);
+		reslice_pid[cpu] = 0;
+	}
+
+	if (slice_ext_ns && p->scx.slice == 0) {
+		try_extend_slice(p);
+		return;
+	}
+
+	if (!is_interactive(scx_bpf_task_cpu(p)) || p->nr_cpus_allowed == 1)
+		return;
+
+	tctx = lookup_task_ctx(p);
+	if (tctx && tctx->level == 1)
+		p->scx.slice = 0;
+}
+
+/*
+ * task_level outlives the scheduler (it is pinned, see MLFQ_STATE_DIR), so a
+ * task coming back after a reload still has its entry. Keep what was
+ * learned about it and drop what only made sense while it was queued.
+ */
+static __always_inline bool restore_task_ctx(struct task_struct *p, u32 pid, u64 start)
+{
+	struct task_ctx *tctx = bpf_map_lookup_elem(&task_level, &pid);
+
+	if (!tctx || tctx->start_ns != start || tctx->level >= MLFQ_NR_LEVELS)
+		return false;
+
+	tctx->user_pending = 0;
+	tctx->slice_ext = 0;
+	tctx->rec_slot = 0;
+	tctx->enq_ns = 0;
+	tctx->agg_wait_ns = 0;
+	rec_open(tctx, pid);
+
+	__sync_fetch_and_add(&nr_tasks_level[tctx->level], 1);
+	stat_inc(STAT_RESTORED);
+	return true;
+}
+
+/* Earliest rule whose prefix matches @p's comm, see rule_comm_index() */
+static __always_inline u32 rule_lookup_comm(void *trie, struct task_struct *p)
+{
+	struct rule_comm_key key = { .prefixlen = 8 * sizeof(key.comm) };
+	u32 *idx;
+
+	bpf_probe_read_kernel_str(key.comm, sizeof(key.comm), p->comm);
+	idx = bpf_map_lookup_elem(trie, &key);
+	return idx ? *idx : MLFQ_MAX_RULES;
+}
+
+/* Index of the earliest rule matching @p by cgroup, comm or parent comm */
+static __always_inline u32 find_rule(struct task_struct *p)
+{
+	u64 cgid = BPF_CORE_READ(p, cgroups, dfl_cgrp, kn, id);
+	u32 best = MLFQ_MAX_RULES, idx, *cg;
+
+	cg = bpf_map_lookup_elem(&rule_cgroup, &cgid);
+	if (cg)
+		best = *cg;
+
+	idx = rule_lookup_comm(&rule_comm, p);
+	if (idx < best)
+		best = idx;
+
+	idx = rule_lookup_comm(&rule_pcomm, BPF_CORE_READ(p, real_parent));
+	if (idx < best)
+		best = idx;
+	return best;
+}
+
+/* Rule @idx, counted as a classification, or NULL if @idx is no rule */
+static __always_inline struct mlfq_rule *claim_rule(u32 idx)
+{
+	struct mlfq_rule *rule;
+	u64 *hits;
+
+	if (idx >= MLFQ_MAX_RULES)
+		return NULL;
+
+	rule = bpf_map_lookup_elem(&rules, &idx);
+	if (!rule)
+		return NULL;
+
+	hits = bpf_map_lookup_elem(&rule_hits, &idx);
+	if (hits)
+		(*hits)++;
+	stat_inc(STAT_RULE_MATCH);
+	return rule;
 }
 
 void BPF_STRUCT_OPS(mlfq_enable, struct task_struct *p)
 {
-	set_level(p, 0);
+	PROF_SCOPE(PROF_ENABLE);
+	u64 now = bpf_ktime_get_ns();
+	struct task_ctx tctx = { .last_cpu = -1, .usage_stamp_ns = now };
+	u32 pid = task_pid(p);
+	u64 start = BPF_CORE_READ(p, start_time);
+	struct mlfq_rule *rule = NULL;
+	u32 idx;
+
+	if (restore_task_ctx(p, pid, start))
+		return;
+
+	if (have_rules) {
+		idx = find_rule(p);
+		rule = claim_rule(idx);
+		if (rule)
+			tctx.rule_id = idx + 1;
+	}
+	if (rule) {
+		tctx.level = rule->level < MLFQ_NR_LEVELS ? rule->level :
+							    initial_level(p, now);
+		tctx.hi_slice_ns = rule->slice_ns;
+		tctx.demote = rule->demote;
+	} else {
+		tctx.level = initial_level(p, now);
+	}
+	tctx.start_ns = start;
+	rec_open(&tctx, pid);
+
+	bpf_map_update_elem(&task_level, &pid, &tctx, BPF_ANY);
+	__sync_fetch_and_add(&nr_tasks_level[tctx.level], 1);
+}
+
+/*
+ * A forked child is enabled under its parent's comm: classify it again
+ * once exec has given it its own. Renames through PR_SET_NAME are not
+ * seen. The task is current here, so it sits on no DSQ; only a result
+ * that differs from the previous one is counted and applied.
+ */
+SEC("tp_btf/sched_process_exec")
+int BPF_PROG(mlfq_exec, struct task_struct *p, pid_t old_pid, struct linux_binprm *bprm)
+{
+	u32 pid = task_pid(p), idx, cpu;
+	struct mlfq_rule *rule;
+	struct task_ctx *tctx;
+
+	if (!have_rules)
+		return 0;
+
+	/* not a sched_ext task */
+	tctx = bpf_map_lookup_elem(&task_level, &pid);
+	if (!tctx)
+		return 0;
+
+	idx = find_rule(p);
+	if (idx + 1 == tctx->rule_id || (idx >= MLFQ_MAX_RULES && !tctx->rule_id))
+		return 0;
+
+	rule = claim_rule(idx);
+	if (!rule) {
+		tctx->rule_id = 0;
+		tctx->hi_slice_ns = 0;
+		tctx->demote = RULE_DEMOTE_DEFAULT;
+		return 0;
+	}
+
+	tctx->rule_id = idx + 1;
+	tctx->hi_slice_ns = rule->slice_ns;
+	tctx->demote = rule->demote;
+
+	if (rule->level < MLFQ_NR_LEVELS && rule->level != tctx->level) {
+		if (tctx->level < MLFQ_NR_LEVELS)
+			__sync_fetch_and_add(&nr_tasks_level[tctx->level], -1);
+		tctx->level = rule->level;
+		__sync_fetch_and_add(&nr_tasks_level[rule->level], 1);
+		rec_level(tctx);
+		/* its running slice was sized for the old level; mlfq_tick resizes it */
+		cpu = bpf_get_smp_processor_id();
+		if (cpu < MLFQ_MAX_CPUS)
+			reslice_pid[cpu] = pid;
+	}
+	return 0;
 }
 
 void BPF_STRUCT_OPS(mlfq_disable, struct task_struct *p)
 {
+	PROF_SCOPE(PROF_DISABLE);
+	struct task_ctx *tctx = lookup_task_ctx(p);
+
+	if (tctx && tctx->level < MLFQ_NR_LEVELS)
+		__sync_fetch_and_add(&nr_tasks_level[tctx->level], -1);
+
+	if (tctx)
+		rec_close(tctx);
+
+	/*
+	 * The scheduler is being unloaded under a live SCHED_EXT task: keep
+	 * its entry for the next load. Exiting tasks and tasks switching to
+	 * another policy are gone for good.
+	 */
+	if (p->policy == SCHED_EXT && !(p->flags & PF_EXITING))
+		return;
+
 	/* DONE in LO: task is leaving sched_ext while it is in LO */
-	if (get_level(p) == 1)
-		emit_event(p, EV_DONE_LO);
+	if (tctx && tctx->level == 1)
+		emit_event(p, EV_DONE_LO, 1, false);
 
+	release_hint(task_pid(p));
 	del_level(p);
 }
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(mlfq_init)
 {
+	u32 cpu, nr_cpus = scx_bpf_nr_cpu_ids();
 	int ret;
 
 	ret = scx_bpf_create_dsq(DSQ_HI, -1);
@@ -192,6 +1781,45 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(mlfq_init)
 	if (ret)
 		return ret;
 
+	bpf_for(cpu, 0, MLFQ_MAX_CPUS) {
+		if (cpu >= nr_cpus)
+			break;
+		ret = scx_bpf_create_dsq(DSQ_PCPU(cpu, 0), -1);
+		if (!ret)
+			ret = scx_bpf_create_dsq(DSQ_PCPU(cpu, 1), -1);
+		if (ret)
+			return ret;
+	}
+
+	ret = wake_masks_init();
+	if (ret)
+		return ret;
+
+#ifdef MLFQ_ARENA
+	ret = arena_init();
+	if (ret)
+		return ret;
+#endif
+
+	if (user_mode) {
+		struct user_timer *ut;
+		u32 key = 0;
+
+		ret = scx_bpf_create_dsq(DSQ_USER, -1);
+		if (ret)
+			return ret;
+
+		ut = bpf_map_lookup_elem(&user_timers, &key);
+		if (!ut)
+			return -ESRCH;
+
+		bpf_timer_init(&ut->timer, &user_timers, CLOCK_MONOTONIC);
+		bpf_timer_set_callback(&ut->timer, user_timer_fn);
+		ret = bpf_timer_start(&ut->timer, user_tick_ns, 0);
+		if (ret)
+			return ret;
+	}
+
 	return 0;
 }
 
@@ -204,7 +1832,9 @@ SCX_OPS_DEFINE(mlfq_ops,
 	       .select_cpu	= (void *)mlfq_select_cpu,
 	       .enqueue		= (void *)mlfq_enqueue,
 	       .dispatch	= (void *)mlfq_dispatch,
+	       .running		= (void *)mlfq_running,
 	       .stopping	= (void *)mlfq_stopping,
+	       .tick		= (void *)mlfq_tick,
 	       .enable		= (void *)mlfq_enable,
 	       .disable		= (void *)mlfq_disable,
 	       .init		= (void *)mlfq_init,
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 #include <libgen.h>
@@ -6,33 +8,38 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <scx/common.h>
+#include "scx_mlfq.h"
 #include "scx_mlfq.bpf.skel.h"
+#include "metrics_http.h"
+#include "state_pin.h"
+#include "sched_prof.h"
 
 #define PRINT_INTERVAL_MS 50
 
+/* How long the policy thread blocks waiting for hand-offs */
+#define USER_POLL_MS 1
+
+/* Ringbuf size while recording a timeline (-T) */
+#define TRACE_RINGBUF_SZ (16U << 20)
+
 static bool verbose;
+static bool dump_migrations;
+static unsigned short metrics_port;
 static volatile sig_atomic_t exit_req;
 
 /* time-zero for pretty event timestamps */
 static uint64_t t0_ns;
 
-/* Must match BPF event struct + enums */
-enum ev_type {
-	EV_DEMOTE  = 1,
-	EV_DONE_LO = 2,
-};
-
-struct ev {
-	uint64_t ts_ns;
-	uint32_t cpu;
-	uint32_t pid;
-	uint8_t  type;
-	uint8_t  _pad[3];
-};
+/* Timeline recording (-T): raw struct ev records after a mlfq_trace_hdr */
+static FILE *trace_fp;
+static struct mlfq_trace_hdr trace_hdr;
 
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 {
@@ -55,6 +62,12 @@ static int handle_event(void *ctx, void *data, size_t data_sz)
 
 	const struct ev *e = (const struct ev *)data;
 
+	if (trace_fp) {
+		if (fwrite(e, sizeof(*e), 1, trace_fp) == 1)
+			trace_hdr.nr_events++;
+		return 0;
+	}
+
 	/* BPF filters to cpu0 already, but keep this harmless check */
 	if (e->cpu != 0)
 		return 0;
@@ -75,30 +88,1076 @@ static int handle_event(void *ctx, void *data, size_t data_sz)
 	return 0;
 }
 
+static int trace_open(const char *path)
+{
+	trace_fp = fopen(path, "wb");
+	if (!trace_fp) {
+		perror(path);
+		return -1;
+	}
 
-static void read_needed_stats(struct scx_mlfq *skel, __u64 *enq_hi, __u64 *enq_lo, __u64 *demote)
+	memcpy(trace_hdr.magic, MLFQ_TRACE_MAGIC, sizeof(trace_hdr.magic));
+	trace_hdr.ev_size = sizeof(struct ev);
+	fwrite(&trace_hdr, sizeof(trace_hdr), 1, trace_fp);
+	return 0;
+}
+
+/* Rewrite the header with the final event and loss counts */
+static void trace_close(__u64 nr_dropped)
+{
+	if (!trace_fp)
+		return;
+
+	trace_hdr.nr_dropped = nr_dropped;
+	fseek(trace_fp, 0, SEEK_SET);
+	fwrite(&trace_hdr, sizeof(trace_hdr), 1, trace_fp);
+	fclose(trace_fp);
+	trace_fp = NULL;
+
+	fprintf(stderr, "trace: %llu events recorded, %llu dropped (1 in %u pids sampled)\n",
+		(unsigned long long)trace_hdr.nr_events,
+		(unsigned long long)trace_hdr.nr_dropped,
+		1U << trace_hdr.sample_shift);
+}
+
+static void read_stats(struct scx_mlfq *skel, __u64 stats_out[STAT_NR])
 {
 	int nr_cpus = libbpf_num_possible_cpus();
 	__u64 cnts[nr_cpus];
 	__u32 idx;
-	int ret, cpu;
 
-	*enq_hi = *enq_lo = *demote = 0;
+	for (idx = 0; idx < STAT_NR; idx++) {
+		int ret, cpu;
+
+		stats_out[idx] = 0;
+		ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.stats), &idx, cnts);
+		if (ret < 0)
+			continue;
+
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			stats_out[idx] += cnts[cpu];
+	}
+}
+
+#ifdef MLFQ_PROFILE
+/* Callback cost report interval of the profiling build */
+#define PROF_REPORT_MS 1000
+
+static struct sched_prof prof;
+#endif
+
+/*
+ * ---- user-space-assisted mode (-u) ----
+ * A policy only reorders the batch of tasks handed off since the last poll;
+ * the first entry is dispatched first. Anything the policy does not answer
+ * in time is dispatched by the BPF fallback.
+ */
+struct user_policy {
+	const char *name;
+	const char *desc;
+	void (*order)(struct user_task *tasks, int nr);
+};
+
+static void order_fifo(struct user_task *tasks, int nr)
+{
+	(void)tasks;
+	(void)nr;
+}
+
+static int cmp_burst(const void *a, const void *b)
+{
+	const struct user_task *t1 = a, *t2 = b;
+
+	if (t1->last_burst_ns != t2->last_burst_ns)
+		return t1->last_burst_ns < t2->last_burst_ns ? -1 : 1;
+	return (t1->enq_ns > t2->enq_ns) - (t1->enq_ns < t2->enq_ns);
+}
+
+static void order_sjf(struct user_task *tasks, int nr)
+{
+	qsort(tasks, nr, sizeof(*tasks), cmp_burst);
+}
+
+static const struct user_policy user_policies[] = {
+	{ "fifo", "dispatch in hand-off order", order_fifo },
+	{ "sjf",  "shortest previous burst first", order_sjf },
+};
+
+struct user_sched {
+	struct ring_buffer *tasks_rb;
+	struct user_ring_buffer *decisions_rb;
+	const struct user_policy *policy;
+	pthread_t thread;
+	volatile int stop;
+	int nr;
+	struct user_task batch[MLFQ_USER_QUEUE_LEN];
+};
+
+static const struct user_policy *find_user_policy(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(user_policies) / sizeof(user_policies[0]); i++)
+		if (!strcmp(user_policies[i].name, name))
+			return &user_policies[i];
+	return NULL;
+}
+
+static int handle_user_task(void *ctx, void *data, size_t data_sz)
+{
+	struct user_sched *us = ctx;
+
+	if (data_sz < sizeof(struct user_task) || us->nr >= MLFQ_USER_QUEUE_LEN)
+		return 0;
+
+	memcpy(&us->batch[us->nr++], data, sizeof(struct user_task));
+	return 0;
+}
+
+static void *user_policy_thread(void *arg)
+{
+	struct user_sched *us = arg;
+	int i;
+
+	while (!us->stop) {
+		ring_buffer__poll(us->tasks_rb, USER_POLL_MS);
+		if (!us->nr)
+			continue;
+
+		us->policy->order(us->batch, us->nr);
+
+		for (i = 0; i < us->nr; i++) {
+			struct user_decision *d;
+
+			/* Full: the rest will be picked up by the BPF fallback */
+			d = user_ring_buffer__reserve(us->decisions_rb, sizeof(*d));
+			if (!d)
+				break;
+
+			d->enq_ns = us->batch[i].enq_ns;
+			d->slice_ns = 0;
+			d->pid = us->batch[i].pid;
+			d->seq = us->batch[i].seq;
+			user_ring_buffer__submit(us->decisions_rb, d);
+		}
+		us->nr = 0;
+	}
+
+	return NULL;
+}
+
+static struct user_sched *user_sched_start(struct scx_mlfq *skel,
+					   const struct user_policy *policy)
+{
+	struct user_sched *us = calloc(1, sizeof(*us));
+
+	if (!us)
+		return NULL;
+
+	us->policy = policy;
+	us->tasks_rb = ring_buffer__new(bpf_map__fd(skel->maps.user_tasks),
+					handle_user_task, us, NULL);
+	us->decisions_rb = user_ring_buffer__new(bpf_map__fd(skel->maps.user_decisions), NULL);
+	if (!us->tasks_rb || !us->decisions_rb) {
+		fprintf(stderr, "user mode: ringbuf setup failed\n");
+		goto err;
+	}
+
+	if (pthread_create(&us->thread, NULL, user_policy_thread, us)) {
+		fprintf(stderr, "user mode: pthread_create failed\n");
+		goto err;
+	}
+	return us;
+
+err:
+	ring_buffer__free(us->tasks_rb);
+	user_ring_buffer__free(us->decisions_rb);
+	free(us);
+	return NULL;
+}
+
+static void user_sched_stop(struct user_sched *us)
+{
+	if (!us)
+		return;
+
+	us->stop = 1;
+	pthread_join(us->thread, NULL);
+	ring_buffer__free(us->tasks_rb);
+	user_ring_buffer__free(us->decisions_rb);
+	free(us);
+}
+
+/*
+ * ---- shared per-task table (MLFQ_ARENA builds only) ----
+ * The arena is mapped into the loader at the address BPF stores in
+ * task_recs, so the whole table is scanned with plain loads.
+ */
+#ifdef MLFQ_ARENA
+#define ARENA_REPORT_MS 1000
+
+/* Give up on a record that keeps changing while it is copied */
+#define ARENA_READ_TRIES 8
+
+#define ARENA_OPTS "R"
+#define ARENA_USAGE "  -R  print the per-task table from the arena on exit\n"
+
+struct arena_scan {
+	__u64 tasks[MLFQ_NR_LEVELS];
+	__u64 runtime_ns;
+	__u64 wait_ns;
+	__u64 switches;
+	__u64 torn;			/* records skipped after ARENA_READ_TRIES */
+	double scan_us;
+};
+
+static struct arena_scan arena_last;
+static bool dump_arena;
+
+/* Seqlock read of one record; false if the slot is free or never settled */
+static bool read_task_rec(struct task_rec *r, struct task_rec *out, __u64 *torn)
+{
+	int i;
+
+	for (i = 0; i < ARENA_READ_TRIES; i++) {
+		__u32 gen = __atomic_load_n(&r->gen, __ATOMIC_ACQUIRE);
+
+		if (gen & 1)
+			continue;
+		memcpy(out, r, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->gen, __ATOMIC_RELAXED) == gen)
+			return out->pid != 0;
+	}
+	(*torn)++;
+	return false;
+}
+
+/* Calls @fn on a consistent copy of every live record; returns the count */
+static __u64 arena_scan(struct scx_mlfq *skel, struct arena_scan *as,
+			void (*fn)(const struct task_rec *, void *), void *data)
+{
+	struct task_rec *recs = skel->bss->task_recs, rec;
+	struct timespec t0, t1;
+	__u64 nr = 0;
+	__u32 slot;
+
+	memset(as, 0, sizeof(*as));
+	if (!recs)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (slot = 0; slot < MLFQ_ARENA_SLOTS; slot++) {
+		if (!read_task_rec(&recs[slot], &rec, &as->torn))
+			continue;
+
+		if (rec.level < MLFQ_NR_LEVELS)
+			as->tasks[rec.level]++;
+		as->runtime_ns += rec.runtime_ns;
+		as->wait_ns += rec.wait_ns;
+		as->switches += rec.nr_switches;
+		if (fn)
+			fn(&rec, data);
+		nr++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	as->scan_us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+	return nr;
+}
+
+static void report_arena(struct scx_mlfq *skel)
+{
+	arena_scan(skel, &arena_last, NULL, NULL);
+	printf("arena: tasks hi=%llu lo=%llu switches=%llu torn=%llu scan=%.0fus (%u slots)\n",
+	       (unsigned long long)arena_last.tasks[0],
+	       (unsigned long long)arena_last.tasks[1],
+	       (unsigned long long)arena_last.switches,
+	       (unsigned long long)arena_last.torn,
+	       arena_last.scan_us, MLFQ_ARENA_SLOTS);
+}
+
+struct rec_list {
+	struct task_rec *recs;
+	__u64 nr;
+};
 
-	idx = 0;
-	ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.stats), &idx, cnts);
-	if (ret == 0)
-		for (cpu = 0; cpu < nr_cpus; cpu++) *enq_hi += cnts[cpu];
+static void collect_rec(const struct task_rec *rec, void *data)
+{
+	struct rec_list *l = data;
 
-	idx = 1;
-	ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.stats), &idx, cnts);
-	if (ret == 0)
-		for (cpu = 0; cpu < nr_cpus; cpu++) *enq_lo += cnts[cpu];
+	l->recs[l->nr++] = *rec;
+}
+
+static int cmp_runtime_desc(const void *a, const void *b)
+{
+	const struct task_rec *x = a, *y = b;
+
+	return x->runtime_ns < y->runtime_ns ? 1 : x->runtime_ns > y->runtime_ns ? -1 : 0;
+}
+
+static void print_arena_tasks(struct scx_mlfq *skel)
+{
+	struct rec_list l = { .recs = calloc(MLFQ_ARENA_SLOTS, sizeof(*l.recs)) };
+	struct arena_scan as;
+	__u64 i;
+
+	if (!l.recs)
+		return;
+
+	arena_scan(skel, &as, collect_rec, &l);
+	qsort(l.recs, l.nr, sizeof(*l.recs), cmp_runtime_desc);
+
+	printf("\n%-8s %-5s %-8s %12s %12s %10s\n",
+	       "PID", "LEVEL", "LAST_CPU", "RUN(ms)", "WAIT(ms)", "SWITCHES");
+	for (i = 0; i < l.nr; i++)
+		printf("%-8u %-5s %-8d %12.3f %12.3f %10llu\n",
+		       l.recs[i].pid, l.recs[i].level ? "LO" : "HI", l.recs[i].last_cpu,
+		       l.recs[i].runtime_ns / 1e6, l.recs[i].wait_ns / 1e6,
+		       (unsigned long long)l.recs[i].nr_switches);
+	printf("%llu tasks, scanned in %.0fus\n", (unsigned long long)l.nr, as.scan_us);
+	free(l.recs);
+}
+#else
+#define ARENA_OPTS ""
+#define ARENA_USAGE ""
+#endif
+
+/*
+ * ---- per-application aggregates (-g) ----
+ * tgid_stats and comm_stats hold one struct agg_stats per CPU; a read sums
+ * them, so a refresh costs one lookup per application however many
+ * threads it runs.
+ */
+#define AGG_REPORT_MS 1000
+#define AGG_TOP 10
+
+struct agg_row {
+	__u32 tgid;
+	char comm[16];
+	struct agg_stats s;
+};
+
+struct agg_table {
+	struct agg_row *rows;
+	__u32 nr;
+	double read_us;
+};
+
+static bool show_agg;
+static struct agg_table agg_tgid, agg_comm;
+
+static int cmp_agg_runtime_desc(const void *a, const void *b)
+{
+	const struct agg_row *x = a, *y = b;
+
+	return x->s.runtime_ns < y->s.runtime_ns ? 1 :
+	       x->s.runtime_ns > y->s.runtime_ns ? -1 : 0;
+}
+
+/* Sum every entry of a per-CPU aggregate map into @t, busiest first */
+static void agg_read(int fd, bool by_comm, struct agg_table *t)
+{
+	int cpu, nr_cpus = libbpf_num_possible_cpus();
+	struct agg_stats vals[nr_cpus];
+	union {
+		__u32 tgid;
+		struct comm_key comm;
+	} key, *prev = NULL;
+	struct timespec t0, t1;
+
+	if (!t->rows)
+		t->rows = calloc(MLFQ_AGG_ENTRIES, sizeof(*t->rows));
+	t->nr = 0;
+	if (!t->rows)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (t->nr < MLFQ_AGG_ENTRIES && !bpf_map_get_next_key(fd, prev, &key)) {
+		struct agg_row *r = &t->rows[t->nr];
+
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, vals))
+			continue;	/* evicted since get_next_key */
+
+		memset(r, 0, sizeof(*r));
+		if (by_comm)
+			memcpy(r->comm, key.comm.comm, sizeof(r->comm) - 1);
+		else
+			r->tgid = key.tgid;
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			r->s.runtime_ns += vals[cpu].runtime_ns;
+			r->s.wait_ns += vals[cpu].wait_ns;
+			r->s.nr_switches += vals[cpu].nr_switches;
+			r->s.nr_demotions += vals[cpu].nr_demotions;
+		}
+		t->nr++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	t->read_us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+
+	qsort(t->rows, t->nr, sizeof(*t->rows), cmp_agg_runtime_desc);
+}
+
+/* Name of a tgid for display; the process may already be gone */
+static void tgid_comm(__u32 tgid, char *buf, size_t len)
+{
+	char path[32];
+	FILE *f;
 
-	idx = 4;
-	ret = bpf_map_lookup_elem(bpf_map__fd(skel->maps.stats), &idx, cnts);
-	if (ret == 0)
-		for (cpu = 0; cpu < nr_cpus; cpu++) *demote += cnts[cpu];
+	snprintf(path, sizeof(path), "/proc/%u/comm", tgid);
+	f = fopen(path, "r");
+	if (!f || !fgets(buf, len, f))
+		snprintf(buf, len, "?");
+	else
+		buf[strcspn(buf, "\n")] = '\0';
+	if (f)
+		fclose(f);
+}
+
+static void print_agg_rows(const char *title, const struct agg_table *t, bool by_comm)
+{
+	__u32 i;
+
+	printf("%-8s %-16s %12s %12s %10s %8s\n",
+	       title, "COMM", "RUN(ms)", "WAIT(ms)", "SWITCHES", "DEMOTES");
+	for (i = 0; i < t->nr && i < AGG_TOP; i++) {
+		const struct agg_row *r = &t->rows[i];
+		char comm[16], id[16];
+
+		if (by_comm) {
+			snprintf(comm, sizeof(comm), "%s", r->comm);
+			snprintf(id, sizeof(id), "-");
+		} else {
+			tgid_comm(r->tgid, comm, sizeof(comm));
+			snprintf(id, sizeof(id), "%u", r->tgid);
+		}
+		printf("%-8s %-16s %12.3f %12.3f %10llu %8llu\n",
+		       id, comm, r->s.runtime_ns / 1e6, r->s.wait_ns / 1e6,
+		       (unsigned long long)r->s.nr_switches,
+		       (unsigned long long)r->s.nr_demotions);
+	}
+}
+
+static void report_agg(struct scx_mlfq *skel)
+{
+	agg_read(bpf_map__fd(skel->maps.tgid_stats), false, &agg_tgid);
+	agg_read(bpf_map__fd(skel->maps.comm_stats), true, &agg_comm);
+
+	printf("agg: %u processes, %u comms, read in %.0fus\n",
+	       agg_tgid.nr, agg_comm.nr, agg_tgid.read_us + agg_comm.read_us);
+	print_agg_rows("TGID", &agg_tgid, false);
+	print_agg_rows("", &agg_comm, true);
+}
+
+/*
+ * ---- classification rules (-r) ----
+ * One rule per line, the earliest matching rule wins:
+ *   comm=PREFIX | pcomm=PREFIX | cgroup=PATH  [level=hi|lo] [slice_us=N] [demote=default|never]
+ * comm/pcomm match a prefix of the task's or its parent's comm, cgroup the
+ * task's cgroup v2 directory. Blank lines and '#' comments are ignored.
+ */
+enum rule_kind {
+	RULE_COMM,
+	RULE_PCOMM,
+	RULE_CGROUP,
+};
+
+struct rule_src {
+	char match[64];			/* as written, for reports */
+	enum rule_kind kind;
+	char comm[16];
+	__u64 cgid;
+	struct mlfq_rule rule;
+};
+
+static struct rule_src rule_srcs[MLFQ_MAX_RULES];
+static int nr_rules;
+
+static int parse_rule(struct rule_src *r, char *line)
+{
+	char *tok, *save, *val;
+
+	memset(r, 0, sizeof(*r));
+	r->rule.level = MLFQ_RULE_LEVEL_KEEP;
+
+	tok = strtok_r(line, " \t", &save);
+	val = strchr(tok, '=');
+	if (!val || !val[1])
+		return -1;
+	*val++ = '\0';
+	snprintf(r->match, sizeof(r->match), "%s=%s", tok, val);
+
+	if (!strcmp(tok, "comm") || !strcmp(tok, "pcomm")) {
+		r->kind = tok[0] == 'p' ? RULE_PCOMM : RULE_COMM;
+		if (strlen(val) >= sizeof(r->comm))
+			return -1;
+		strcpy(r->comm, val);
+	} else if (!strcmp(tok, "cgroup")) {
+		struct stat st;
+
+		if (stat(val, &st)) {
+			perror(val);
+			return -1;
+		}
+		r->kind = RULE_CGROUP;
+		r->cgid = st.st_ino;	/* cgroup v2 id is the directory's inode */
+	} else {
+		return -1;
+	}
+
+	while ((tok = strtok_r(NULL, " \t", &save))) {
+		val = strchr(tok, '=');
+		if (!val)
+			return -1;
+		*val++ = '\0';
+
+		if (!strcmp(tok, "level") && !strcmp(val, "hi"))
+			r->rule.level = 0;
+		else if (!strcmp(tok, "level") && !strcmp(val, "lo"))
+			r->rule.level = 1;
+		else if (!strcmp(tok, "slice_us"))
+			r->rule.slice_ns = strtoull(val, NULL, 0) * 1000;
+		else if (!strcmp(tok, "demote") && !strcmp(val, "default"))
+			r->rule.demote = RULE_DEMOTE_DEFAULT;
+		else if (!strcmp(tok, "demote") && !strcmp(val, "never"))
+			r->rule.demote = RULE_DEMOTE_NEVER;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+static int load_rules(const char *path)
+{
+	char line[512];
+	FILE *f = fopen(path, "r");
+	int lineno = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	nr_rules = 0;
+	while (fgets(line, sizeof(line), f)) {
+		char *c = line + strspn(line, " \t");
+
+		lineno++;
+		c[strcspn(c, "#\r\n")] = '\0';
+		if (!*c)
+			continue;
+
+		if (nr_rules >= MLFQ_MAX_RULES) {
+			fprintf(stderr, "%s:%d: more than %d rules\n", path, lineno, MLFQ_MAX_RULES);
+			break;
+		}
+		if (parse_rule(&rule_srcs[nr_rules], c)) {
+			fprintf(stderr, "%s:%d: bad rule\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+		nr_rules++;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * The comm tries return the longest matching prefix, not the earliest rule.
+ * Every rule matching a task has a prefix of that longest key, so storing
+ * under each key the earliest rule among the same-kind keys that prefix it
+ * makes the trie lookup yield the earliest match.
+ */
+static __u32 rule_comm_index(__u32 i)
+{
+	const struct rule_src *r = &rule_srcs[i];
+	__u32 j;
+
+	for (j = 0; j < i; j++) {
+		const struct rule_src *e = &rule_srcs[j];
+
+		if (e->kind == r->kind && !strncmp(e->comm, r->comm, strlen(e->comm)))
+			return j;
+	}
+	return i;
+}
+
+/* After load, before attach: every task enabled from here on is matched */
+static int apply_rules(struct scx_mlfq *skel)
+{
+	__u32 i, idx;
+
+	for (i = 0; i < (__u32)nr_rules; i++) {
+		const struct rule_src *r = &rule_srcs[i];
+		struct rule_comm_key ck = { .prefixlen = 8 * strlen(r->comm) };
+		int ret;
+
+		ret = bpf_map_update_elem(bpf_map__fd(skel->maps.rules), &i, &r->rule, BPF_ANY);
+		if (ret)
+			return ret;
+
+		/* an earlier rule for the same key keeps it */
+		memcpy(ck.comm, r->comm, sizeof(ck.comm));
+		if (r->kind == RULE_CGROUP) {
+			ret = bpf_map_update_elem(bpf_map__fd(skel->maps.rule_cgroup),
+						  &r->cgid, &i, BPF_NOEXIST);
+		} else {
+			idx = rule_comm_index(i);
+			ret = bpf_map_update_elem(r->kind == RULE_COMM ?
+						  bpf_map__fd(skel->maps.rule_comm) :
+						  bpf_map__fd(skel->maps.rule_pcomm),
+						  &ck, &idx, BPF_NOEXIST);
+		}
+		if (ret && ret != -EEXIST) {
+			fprintf(stderr, "rule %u (%s): %s\n", i, r->match, strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void read_rule_hits(struct scx_mlfq *skel, __u64 hits[MLFQ_MAX_RULES])
+{
+	int cpu, nr_cpus = libbpf_num_possible_cpus();
+	__u64 cnts[nr_cpus];
+	__u32 i;
+
+	for (i = 0; i < (__u32)nr_rules; i++) {
+		hits[i] = 0;
+		if (bpf_map_lookup_elem(bpf_map__fd(skel->maps.rule_hits), &i, cnts))
+			continue;
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			hits[i] += cnts[cpu];
+	}
+}
+
+static void print_rule_hits(struct scx_mlfq *skel)
+{
+	__u64 hits[MLFQ_MAX_RULES];
+	int i;
+
+	read_rule_hits(skel, hits);
+	printf("\n%-4s %-40s %-5s %10s %-7s %10s\n",
+	       "RULE", "MATCH", "LEVEL", "SLICE(us)", "DEMOTE", "HITS");
+	for (i = 0; i < nr_rules; i++) {
+		const struct mlfq_rule *r = &rule_srcs[i].rule;
+
+		printf("%-4d %-40s %-5s %10llu %-7s %10llu\n", i, rule_srcs[i].match,
+		       r->level == 0 ? "hi" : r->level == 1 ? "lo" : "-",
+		       (unsigned long long)r->slice_ns / 1000,
+		       r->demote == RULE_DEMOTE_NEVER ? "never" : "default",
+		       (unsigned long long)hits[i]);
+	}
+}
+
+/*
+ * ---- partition mode (-P) ----
+ * The interactive set is taken from the highest CPU ids down and resized
+ * every PART_ADJUST_MS: it grows while HI tasks wait longer than the target
+ * on average or pile up beyond one per interactive CPU, and shrinks once
+ * the wait is well below target with nothing queued.
+ */
+#define PART_ADJUST_MS 200
+
+struct partition {
+	int nr_cpus;			/* CPUs that can be partitioned */
+	int min, max;			/* bounds on the interactive set */
+	int nr_interactive;
+	__u64 target_wait_ns;
+	__u64 last_waits, last_wait_ns;
+	__u64 last_busy[2];		/* interactive, batch */
+	double wait_avg_ns;		/* over the last interval */
+	double util[2];			/* ... per set */
+	double last_s;
+};
+
+static struct partition part;
+
+static double mono_now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void partition_apply(struct scx_mlfq *skel)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < part.nr_cpus; cpu++)
+		skel->bss->cpu_interactive[cpu] = cpu >= part.nr_cpus - part.nr_interactive;
+	/* the flags must land before BPF sees the new generation */
+	__sync_synchronize();
+	skel->bss->partition_gen++;
+}
+
+/* Counters may carry over from an earlier load; deltas start from here */
+static void partition_reset(struct scx_mlfq *skel)
+{
+	__u64 st[STAT_NR];
+
+	read_stats(skel, st);
+	part.last_waits = st[STAT_HI_WAITS];
+	part.last_wait_ns = st[STAT_HI_WAIT_NS];
+	part.last_busy[0] = st[STAT_BUSY_INTERACTIVE_NS];
+	part.last_busy[1] = st[STAT_BUSY_BATCH_NS];
+	part.last_s = mono_now_s();
+	partition_apply(skel);
+}
+
+static void partition_adjust(struct scx_mlfq *skel, const __u64 st[STAT_NR])
+{
+	double now = mono_now_s(), dt = now - part.last_s;
+	__u64 waits, depth = skel->bss->dsq_depth[0];
+	int n = part.nr_interactive, i;
+
+	if (dt < PART_ADJUST_MS / 1e3)
+		return;
+
+	waits = st[STAT_HI_WAITS] - part.last_waits;
+	part.wait_avg_ns = waits ? (double)(st[STAT_HI_WAIT_NS] - part.last_wait_ns) / waits : 0;
+
+	for (i = 0; i < 2; i++) {
+		__u64 busy = st[STAT_BUSY_INTERACTIVE_NS + i];
+		int cpus = i == 0 ? n : part.nr_cpus - n;
+
+		part.util[i] = cpus ? (busy - part.last_busy[i]) / (dt * 1e9 * cpus) : 0;
+		part.last_busy[i] = busy;
+	}
+
+	if (part.wait_avg_ns > part.target_wait_ns || depth > (__u64)n)
+		n++;
+	else if (part.wait_avg_ns < part.target_wait_ns / 4 && !depth)
+		n--;
+
+	if (n < part.min)
+		n = part.min;
+	if (n > part.max)
+		n = part.max;
+
+	if (n != part.nr_interactive) {
+		part.nr_interactive = n;
+		partition_apply(skel);
+	}
+
+	part.last_waits = st[STAT_HI_WAITS];
+	part.last_wait_ns = st[STAT_HI_WAIT_NS];
+	part.last_s = now;
+
+	printf("partition: interactive=%d/%d hi_wait_avg=%.1fus hi_depth=%llu "
+	       "util_interactive=%.0f%% util_batch=%.0f%%\n",
+	       part.nr_interactive, part.nr_cpus, part.wait_avg_ns / 1e3,
+	       (unsigned long long)depth, part.util[0] * 100, part.util[1] * 100);
+}
+
+/*
+ * ---- state kept across restarts and redeploys ----
+ * Learned per-task levels, admission buckets, aggregates and counters are
+ * pinned under MLFQ_STATE_DIR and handed to the next load, whether it comes
+ * from a UEI restart or a new loader process. -F starts over. The
+ * aggregate maps only exist with -g, so only then are they pinned.
+ */
+static const char *const state_maps[] = {
+	"task_level", "stats", "admit_buckets", NULL,
+};
+
+static const char *const state_maps_agg[] = {
+	"task_level", "stats", "admit_buckets", "tgid_stats", "comm_stats", NULL,
+};
+
+struct state_info {
+	int reused;			/* maps taken over from the previous load */
+	struct state_meta meta;
+	double attach_s;		/* open to attached, this load */
+	double down_s;			/* detach to attached again, UEI restarts only */
+};
+
+static struct state_info state;
+static bool fresh_state;
+
+/* Counter names for the metrics endpoint, indexed by enum mlfq_stat */
+static const char *const stat_names[STAT_NR] = {
+	[STAT_ENQ_HI]		= "enqueue_hi",
+	[STAT_ENQ_LO]		= "enqueue_lo",
+	[STAT_CONS_HI]		= "consume_hi",
+	[STAT_CONS_LO]		= "consume_lo",
+	[STAT_DEMOTE]		= "demote",
+	[STAT_MIG_SAME_CORE]	= "migrate_same_core",
+	[STAT_MIG_SAME_LLC]	= "migrate_same_llc",
+	[STAT_MIG_CROSS_LLC]	= "migrate_cross_llc",
+	[STAT_STICKY]		= "sticky",
+	[STAT_STICKY_MISS]	= "sticky_miss",
+	[STAT_EV_DROP]		= "trace_drop",
+	[STAT_DISPATCH]		= "dispatch",
+	[STAT_DISPATCH_USEFUL]	= "dispatch_useful",
+	[STAT_USER_ENQ]		= "user_enqueue",
+	[STAT_USER_DISPATCH]	= "user_dispatch",
+	[STAT_USER_FALLBACK]	= "user_fallback",
+	[STAT_USER_STALE]	= "user_stale",
+	[STAT_USER_FULL]	= "user_full",
+	[STAT_USER_RTT_NS]	= "user_rtt_ns",
+	[STAT_INHERIT]		= "inherit",
+	[STAT_INHERIT_LO]	= "inherit_lo",
+	[STAT_ADMIT_REJECT]	= "admit_reject",
+	[STAT_PINNED]		= "pinned",
+	[STAT_CONS_PCPU]	= "consume_pcpu",
+	[STAT_HI_WAITS]		= "hi_waits",
+	[STAT_HI_WAIT_NS]	= "hi_wait_ns",
+	[STAT_BUSY_INTERACTIVE_NS] = "busy_interactive_ns",
+	[STAT_BUSY_BATCH_NS]	= "busy_batch_ns",
+	[STAT_EXT_GRANT]	= "slice_ext_grant",
+	[STAT_EXT_DENY]		= "slice_ext_deny",
+	[STAT_EXT_NS]		= "slice_ext_ns",
+	[STAT_WAKE_SYNC]	= "wake_sync",
+	[STAT_WAKE_LLC]		= "wake_llc",
+	[STAT_WAKE_FLIPPY]	= "wake_flippy",
+	[STAT_RESTORED]		= "restored",
+	[STAT_RULE_MATCH]	= "rule_match",
+	[STAT_CTX_MISS]		= "ctx_miss",
+	[STAT_EXT_DEBT_NS]	= "slice_ext_debt_ns",
+};
+
+/* HELP text for each counter; see enum mlfq_stat */
+static const char *const stat_help[STAT_NR] = {
+	[STAT_ENQ_HI]		= "Tasks enqueued at the HI level",
+	[STAT_ENQ_LO]		= "Tasks enqueued at the LO level",
+	[STAT_CONS_HI]		= "Tasks moved from DSQ_HI to a local DSQ",
+	[STAT_CONS_LO]		= "Tasks moved from DSQ_LO to a local DSQ",
+	[STAT_DEMOTE]		= "HI tasks demoted to LO",
+	[STAT_MIG_SAME_CORE]	= "Migrations to an SMT sibling",
+	[STAT_MIG_SAME_LLC]	= "Migrations to another core sharing the LLC",
+	[STAT_MIG_CROSS_LLC]	= "Migrations across LLCs",
+	[STAT_STICKY]		= "LO tasks queued back on their cache-hot CPU",
+	[STAT_STICKY_MISS]	= "Cache-hot LO tasks whose previous CPU stayed busy",
+	[STAT_EV_DROP]		= "Trace events lost to backlog or a full ringbuf",
+	[STAT_DISPATCH]		= "mlfq_dispatch invocations",
+	[STAT_DISPATCH_USEFUL]	= "mlfq_dispatch invocations that moved at least one task",
+	[STAT_USER_ENQ]		= "Tasks handed to the userspace policy",
+	[STAT_USER_DISPATCH]	= "Tasks dispatched on the userspace policy's decision",
+	[STAT_USER_FALLBACK]	= "Userspace-policy tasks dispatched by BPF after the timeout",
+	[STAT_USER_STALE]	= "Userspace decisions for tasks no longer pending",
+	[STAT_USER_FULL]	= "Enqueues that could not be handed to the userspace policy",
+	[STAT_USER_RTT_NS]	= "Summed enqueue-to-decision latency of the userspace policy (ns)",
+	[STAT_INHERIT]		= "New tasks whose level came from a tracked parent",
+	[STAT_INHERIT_LO]	= "New tasks that started in LO (parent LO or CPU busy)",
+	[STAT_ADMIT_REJECT]	= "Fresh children kept out of HI by the admission rate limit",
+	[STAT_PINNED]		= "Single-CPU tasks queued on their CPU's own DSQ",
+	[STAT_CONS_PCPU]	= "Tasks moved from a per-CPU DSQ to the local DSQ",
+	[STAT_HI_WAITS]		= "HI tasks that went from enqueue to running",
+	[STAT_HI_WAIT_NS]	= "Summed enqueue-to-running time of HI tasks (ns)",
+	[STAT_BUSY_INTERACTIVE_NS] = "Run time on interactive CPUs in partition mode (ns)",
+	[STAT_BUSY_BATCH_NS]	= "Run time on batch CPUs in partition mode (ns)",
+	[STAT_EXT_GRANT]	= "HI slices extended for a task in a critical section",
+	[STAT_EXT_DENY]		= "Slice extensions refused because the slice was already extended",
+	[STAT_EXT_NS]		= "Slice extension time actually used (ns)",
+	[STAT_WAKE_SYNC]	= "Sync wakeups run next on the waker's CPU",
+	[STAT_WAKE_LLC]		= "Affine wakeups placed on an idle CPU in the waker's LLC",
+	[STAT_WAKE_FLIPPY]	= "Wake affinity skipped because the waker changes too often",
+	[STAT_RESTORED]		= "Tasks that kept their state across a reload",
+	[STAT_RULE_MATCH]	= "New tasks classified by a -r rule",
+	[STAT_CTX_MISS]		= "task_level lookups that missed (LRU eviction)",
+	[STAT_EXT_DEBT_NS]	= "Slice extension time taken off later HI slices (ns)",
+};
+
+static void render_metrics(struct scx_mlfq *skel, const __u64 st[STAT_NR],
+			   struct metrics_buf *mb)
+{
+	static const char *const level_labels[MLFQ_NR_LEVELS] = {
+		"level=\"hi\"", "level=\"lo\"",
+	};
+	char name[64];
+	int i;
+
+	metrics_buf_reset(mb);
+
+	for (i = 0; i < STAT_NR; i++) {
+		snprintf(name, sizeof(name), "scx_mlfq_%s", stat_names[i]);
+		metrics_family(mb, name, "counter", stat_help[i]);
+		metrics_counter(mb, name, NULL, st[i]);
+	}
+
+	metrics_family(mb, "scx_mlfq_dsq_depth", "gauge",
+		       "Tasks queued on the shared DSQ of each level");
+	for (i = 0; i < MLFQ_NR_LEVELS; i++)
+		metrics_gauge(mb, "scx_mlfq_dsq_depth", level_labels[i],
+			      skel->bss->dsq_depth[i]);
+
+	metrics_family(mb, "scx_mlfq_tasks", "gauge",
+		       "Tasks currently tracked at each level");
+	for (i = 0; i < MLFQ_NR_LEVELS; i++)
+		metrics_gauge(mb, "scx_mlfq_tasks", level_labels[i],
+			      skel->bss->nr_tasks_level[i]);
+	metrics_family(mb, "scx_mlfq_task_ctx_capacity", "gauge",
+		       "Entries in task_level before LRU eviction starts");
+	metrics_gauge(mb, "scx_mlfq_task_ctx_capacity", NULL,
+		      bpf_map__max_entries(skel->maps.task_level));
+
+	if (skel->rodata->partition_mode) {
+		static const char *const set_labels[2] = {
+			"set=\"interactive\"", "set=\"batch\"",
+		};
+
+		metrics_family(mb, "scx_mlfq_partition_cpus", "gauge",
+			       "CPUs in each partition");
+		metrics_gauge(mb, "scx_mlfq_partition_cpus", set_labels[0],
+			      part.nr_interactive);
+		metrics_gauge(mb, "scx_mlfq_partition_cpus", set_labels[1],
+			      part.nr_cpus - part.nr_interactive);
+		metrics_family(mb, "scx_mlfq_partition_util", "gauge",
+			       "Busy fraction of each partition over the last adjust interval");
+		for (i = 0; i < 2; i++)
+			metrics_gauge(mb, "scx_mlfq_partition_util", set_labels[i],
+				      part.util[i]);
+	}
+
+#ifdef MLFQ_ARENA
+	metrics_family(mb, "scx_mlfq_arena_tasks", "gauge",
+		       "Live task records in the arena at each level");
+	for (i = 0; i < MLFQ_NR_LEVELS; i++)
+		metrics_gauge(mb, "scx_mlfq_arena_tasks", level_labels[i],
+			      arena_last.tasks[i]);
+	metrics_family(mb, "scx_mlfq_arena_scan_seconds", "gauge",
+		       "Time the last full scan of the arena table took");
+	metrics_gauge(mb, "scx_mlfq_arena_scan_seconds", NULL, arena_last.scan_us / 1e6);
+#endif
+
+	metrics_family(mb, "scx_mlfq_attach_seconds", "gauge",
+		       "Time from opening the BPF object to attached, last load");
+	metrics_gauge(mb, "scx_mlfq_attach_seconds", NULL, state.attach_s);
+	metrics_family(mb, "scx_mlfq_state_loads", "gauge",
+		       "Loads that have used the pinned state, this one included");
+	metrics_gauge(mb, "scx_mlfq_state_loads", NULL, state.meta.loads);
+
+	if (nr_rules) {
+		__u64 hits[MLFQ_MAX_RULES];
+		char label[128];
+		size_t n;
+
+		read_rule_hits(skel, hits);
+		metrics_family(mb, "scx_mlfq_rule_hits", "counter",
+			       "New tasks classified by each -r rule");
+		for (i = 0; i < nr_rules; i++) {
+			n = snprintf(label, sizeof(label), "rule=\"%d\",", i);
+			metrics_label(label + n, sizeof(label) - n, "match", rule_srcs[i].match);
+			metrics_counter(mb, "scx_mlfq_rule_hits", label, hits[i]);
+		}
+	}
+
+	if (show_agg) {
+		static const char *const agg_names[4] = {
+			"scx_mlfq_comm_runtime_ns", "scx_mlfq_comm_wait_ns",
+			"scx_mlfq_comm_switches", "scx_mlfq_comm_demotions",
+		};
+		char label[64];
+		__u32 j;
+
+		for (i = 0; i < 4; i++) {
+			metrics_family(mb, agg_names[i], "counter",
+				       "Per-comm aggregate from comm_stats");
+			for (j = 0; j < agg_comm.nr; j++) {
+				const struct agg_stats *a = &agg_comm.rows[j].s;
+				const __u64 v[4] = {
+					a->runtime_ns, a->wait_ns, a->nr_switches, a->nr_demotions,
+				};
+
+				metrics_label(label, sizeof(label), "comm", agg_comm.rows[j].comm);
+				metrics_counter(mb, agg_names[i], label, v[i]);
+			}
+		}
+	}
+
+#ifdef MLFQ_PROFILE
+	sched_prof_metrics(&prof, mb, "scx_mlfq");
+#endif
+
+	metrics_finish(mb);
+}
+
+/* First CPU id in a sysfs cpulist such as "0-3,8-11"; -1 if unreadable */
+static int read_first_cpu(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	int cpu = -1;
+
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &cpu) != 1)
+		cpu = -1;
+	fclose(f);
+	return cpu;
+}
+
+/*
+ * Fill the BPF topology tables. Each CPU is identified by the first CPU of
+ * its SMT sibling list (core) and of the CPUs sharing its last-level cache.
+ */
+static void init_topology(struct scx_mlfq *skel)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	char path[128];
+	int cpu, id;
+
+	for (cpu = 0; cpu < nr_cpus && cpu < MLFQ_MAX_CPUS; cpu++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		id = read_first_cpu(path);
+		skel->rodata->cpu_core_id[cpu] = id < 0 ? cpu : id;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list", cpu);
+		id = read_first_cpu(path);
+		if (id < 0) {
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cache/index2/shared_cpu_list", cpu);
+			id = read_first_cpu(path);
+		}
+		skel->rodata->cpu_llc_id[cpu] = id < 0 ? 0 : id;
+	}
+}
+
+static void print_task_migrations(struct scx_mlfq *skel)
+{
+	int map_fd = bpf_map__fd(skel->maps.task_level);
+	__u32 *cur_key = NULL, next_key;
+	struct task_ctx tctx;
+
+	printf("%-8s %-6s %-10s %-10s %-10s\n",
+	       "PID", "Level", "SameCore", "SameLLC", "CrossLLC");
+
+	while (bpf_map_get_next_key(map_fd, cur_key, &next_key) == 0) {
+		if (bpf_map_lookup_elem(map_fd, &next_key, &tctx) == 0 &&
+		    (tctx.nr_migrations[MIG_SAME_CORE] ||
+		     tctx.nr_migrations[MIG_SAME_LLC] ||
+		     tctx.nr_migrations[MIG_CROSS_LLC]))
+			printf("%-8u %-6s %-10llu %-10llu %-10llu\n", next_key,
+			       tctx.level ? "LO" : "HI",
+			       (unsigned long long)tctx.nr_migrations[MIG_SAME_CORE],
+			       (unsigned long long)tctx.nr_migrations[MIG_SAME_LLC],
+			       (unsigned long long)tctx.nr_migrations[MIG_CROSS_LLC]);
+		cur_key = &next_key;
+	}
+	fflush(stdout);
+}
+
+/* -X: turn off optional BPF features by name before load */
+static int disable_features(struct scx_mlfq *skel, char *list)
+{
+	char *name, *save = NULL;
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(name, "stats"))
+			skel->rodata->enable_stats = false;
+		else if (!strcmp(name, "events"))
+			skel->rodata->enable_events = false;
+		else if (!strcmp(name, "acct"))
+			skel->rodata->enable_task_acct = false;
+		else {
+			fprintf(stderr, "unknown feature '%s'\n", name);
+			return -1;
+		}
+	}
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -106,6 +1165,19 @@ int main(int argc, char **argv)
 	struct scx_mlfq *skel;
 	struct bpf_link *link;
 	struct ring_buffer *rb = NULL;
+	struct metrics_server *msrv = NULL;
+	struct metrics_buf mb = {};
+	const char *trace_path = NULL;
+	const struct user_policy *user_policy = NULL;
+	struct user_sched *us = NULL;
+	__u64 ev_dropped = 0, ev_dropped_base = 0;
+#ifdef MLFQ_ARENA
+	double arena_report_last = 0;
+#endif
+	double agg_report_last = 0;
+	double open_s, attached_s, detach_s = 0;
+	bool settle_reported;
+	__u64 st_load[STAT_NR];
 	__u32 opt;
 	__u64 ecode;
 
@@ -114,22 +1186,234 @@ int main(int argc, char **argv)
 	signal(SIGTERM, sigint_handler);
 
 restart:
+	open_s = mono_now_s();
 	skel = SCX_OPS_OPEN(mlfq_ops, scx_mlfq);
 
-	while ((opt = getopt(argc, argv, "vh")) != (unsigned)-1) {
+	optind = 1;
+	while ((opt = getopt(argc, argv, "w:m:Mp:T:S:b:u:U:a:i:X:P:W:E:A:gFr:vh" ARENA_OPTS)) != (unsigned)-1) {
 		switch (opt) {
+		case 'w':
+			skel->rodata->cache_hot_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'm':
+			skel->rodata->migration_cost_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'M':
+			dump_migrations = true;
+			break;
+		case 'p':
+			metrics_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'S':
+			trace_hdr.sample_shift = strtoul(optarg, NULL, 0);
+			if (trace_hdr.sample_shift > 16)
+				trace_hdr.sample_shift = 16;
+			break;
+		case 'b':
+			skel->rodata->dispatch_batch = strtoul(optarg, NULL, 0);
+			if (skel->rodata->dispatch_batch < 1)
+				skel->rodata->dispatch_batch = 1;
+			if (skel->rodata->dispatch_batch > MLFQ_MAX_DISPATCH_BATCH)
+				skel->rodata->dispatch_batch = MLFQ_MAX_DISPATCH_BATCH;
+			break;
+		case 'u':
+			user_policy = find_user_policy(optarg);
+			if (!user_policy) {
+				fprintf(stderr, "unknown policy '%s'\n", optarg);
+				return 1;
+			}
+			skel->rodata->user_mode = true;
+			break;
+		case 'U':
+			skel->rodata->user_timeout_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'a': {
+			char *burst;
+
+			skel->rodata->admit_rate = strtoul(optarg, &burst, 0);
+			if (*burst == ',')
+				skel->rodata->admit_burst = strtoul(burst + 1, NULL, 0);
+			if (!skel->rodata->admit_burst)
+				skel->rodata->admit_burst = 1;
+			break;
+		}
+		case 'i':
+			skel->rodata->inherit_busy_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'X':
+			if (disable_features(skel, optarg))
+				return 1;
+			break;
+		case 'P': {
+			char *max;
+
+			part.min = strtol(optarg, &max, 0);
+			part.max = *max == ',' ? strtol(max + 1, NULL, 0) : part.min;
+			skel->rodata->partition_mode = true;
+			break;
+		}
+		case 'W':
+			part.target_wait_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'E':
+			skel->rodata->slice_ext_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'F':
+			fresh_state = true;
+			break;
+		case 'r':
+			if (load_rules(optarg))
+				return 1;
+			skel->rodata->have_rules = nr_rules > 0;
+			break;
+		case 'g':
+			skel->rodata->enable_agg = true;
+			show_agg = true;
+			break;
+		case 'A': {
+			char *pct;
+
+			skel->rodata->wake_affine_votes = strtoul(optarg, &pct, 0);
+			if (*pct == ',')
+				skel->rodata->wake_flip_pct = strtoul(pct + 1, NULL, 0);
+			break;
+		}
+#ifdef MLFQ_ARENA
+		case 'R':
+			dump_arena = true;
+			break;
+#endif
 		case 'v':
 			verbose = true;
 			break;
 		default:
-			fprintf(stderr, "Usage: %s [-v]\n", basename(argv[0]));
+			fprintf(stderr,
+				"Usage: %s [-w cache_hot_us] [-m migration_cost_us] [-M] [-b batch] [-p port]\n"
+				"       [-T trace_file [-S sample_shift]] [-u policy [-U timeout_us]]\n"
+				"       [-a rate[,burst]] [-i busy_pct] [-X features] [-P min[,max] [-W wait_us]]\n"
+				"       [-E ext_us] [-A votes[,flip_pct]] [-g] [-F] [-r rules_file] [-v]\n"
+				"  -w  cache-hot window for LO task stickiness, 0 disables (default 5000)\n"
+				"  -m  max wait for a busy cache-hot CPU before migrating (default 500)\n"
+				"  -M  print per-task migration counts on exit\n"
+				"  -b  max HI tasks moved per dispatch call, 1-32 (default 1)\n"
+				"  -p  serve OpenMetrics on 127.0.0.1:port/metrics\n"
+				"  -T  record enqueue/run/stop/demote events on all CPUs to trace_file\n"
+				"  -S  record only 1 in 2^sample_shift pids (default 0: all)\n"
+				"  -u  order runnable tasks with a userspace policy: fifo, sjf\n"
+				"  -U  dispatch from BPF if the policy has not answered in timeout_us (default 5000)\n"
+				"  -a  new HI tasks admitted per second per parent tgid, 0 disables (default 64,32)\n"
+				"  -i  children of a HI parent busier than busy_pct start in LO (default 50)\n"
+				"  -X  compile out features: stats, events, acct (comma-separated)\n"
+				"  -P  keep min..max CPUs for HI tasks only, resized from the HI wait time\n"
+				"  -W  HI wait the partition resizes towards, in us (default 1000)\n"
+				"  -E  slice extension for HI lock holders (mlfq_hint.h), 0 disables (default 2000)\n"
+				"  -A  place wakees near a waker holding votes wakeups in a row, unless more\n"
+				"      than flip_pct%% of wakeups come from others; 0 disables (default 4,25)\n"
+				"  -g  keep per-tgid and per-comm totals in BPF and print the busiest\n"
+				"  -F  discard the state pinned in " MLFQ_STATE_DIR " by an earlier run\n"
+				"  -r  classify new tasks by comm/pcomm/cgroup rules (see load_rules());\n"
+				"      matched at fork and again at exec, not on PR_SET_NAME renames\n"
+				ARENA_USAGE,
+				basename(argv[0]));
 			return opt != 'h';
 		}
 	}
 
+	init_topology(skel);
+
+	if (skel->rodata->partition_mode) {
+		part.nr_cpus = libbpf_num_possible_cpus();
+		if (part.nr_cpus > MLFQ_MAX_CPUS)
+			part.nr_cpus = MLFQ_MAX_CPUS;
+		if (!part.target_wait_ns)
+			part.target_wait_ns = 1000 * 1000;
+		/* at least one batch CPU must remain for LO work */
+		if (part.max > part.nr_cpus - 1)
+			part.max = part.nr_cpus - 1;
+		if (part.min < 0 || part.min > part.max)
+			part.min = part.max;
+		if (part.nr_interactive < part.min || part.nr_interactive > part.max)
+			part.nr_interactive = part.min;
+		if (!skel->rodata->enable_stats)
+			fprintf(stderr, "partition: stats disabled, interactive set stays at %d CPUs\n",
+				part.nr_interactive);
+	}
+
+	if (trace_path) {
+		skel->rodata->enable_events = true;
+		skel->rodata->trace_all = true;
+		skel->rodata->trace_sample_shift = trace_hdr.sample_shift;
+		skel->rodata->trace_max_backlog = TRACE_RINGBUF_SZ / 2;
+		bpf_map__set_max_entries(skel->maps.events, TRACE_RINGBUF_SZ);
+		if (!trace_fp && trace_open(trace_path))
+			return 1;
+	}
+
+	/* Hand-off ring buffers are only referenced from user_mode branches */
+	if (!skel->rodata->user_mode) {
+		bpf_map__set_autocreate(skel->maps.user_tasks, false);
+		bpf_map__set_autocreate(skel->maps.user_decisions, false);
+	}
+
+	/* Per-tgid/comm aggregates are only referenced under enable_agg (-g) */
+	if (!skel->rodata->enable_agg) {
+		bpf_map__set_autocreate(skel->maps.tgid_stats, false);
+		bpf_map__set_autocreate(skel->maps.comm_stats, false);
+	}
+
+	state.reused = state_pin_reuse(skel->obj, MLFQ_STATE_DIR,
+				       show_agg ? state_maps_agg : state_maps,
+				       MLFQ_STATE_VERSION, fresh_state);
+	fresh_state = false;
+
 	SCX_OPS_LOAD(skel, mlfq_ops, scx_mlfq, uei);
+	state_pin_save(skel->obj, MLFQ_STATE_DIR, show_agg ? state_maps_agg : state_maps,
+		       MLFQ_STATE_VERSION, &state.meta);
+	if (skel->rodata->partition_mode)
+		partition_reset(skel);
+	if (nr_rules && apply_rules(skel)) {
+		fprintf(stderr, "rules: cannot fill the rule maps\n");
+		return 1;
+	}
+
+	/*
+	 * Counters may continue from an earlier load. Take the baseline before
+	 * attaching, which is when tasks are enabled and restored.
+	 */
+	read_stats(skel, st_load);
+	ev_dropped_base = ev_dropped - st_load[STAT_EV_DROP];
+
 	link = SCX_OPS_ATTACH(skel, mlfq_ops, scx_mlfq);
 
+	attached_s = mono_now_s();
+	settle_reported = false;
+	state.attach_s = attached_s - open_s;
+	state.down_s = detach_s ? mono_now_s() - detach_s : 0;
+	printf("state: %s (load %llu), attached in %.1fms",
+	       state.reused > 0 ? "reused pinned maps" : "fresh",
+	       (unsigned long long)state.meta.loads, state.attach_s * 1e3);
+	if (state.down_s)
+		printf(", %.1fms after the restart", state.down_s * 1e3);
+	printf("\n");
+
+	/* The listener outlives UEI restarts; only the snapshot source changes */
+	if (metrics_port && !msrv)
+		msrv = metrics_server_start(metrics_port);
+
+#ifdef MLFQ_PROFILE
+	/* Fresh maps after a restart: start the deltas from zero again */
+	sched_prof_reset(&prof, bpf_map__fd(skel->maps.prof));
+#endif
+
+	if (user_policy) {
+		us = user_sched_start(skel, user_policy);
+		if (!us)
+			exit_req = 1;
+	}
+
 	/* ringbuf setup */
 	{
 		int efd = bpf_map__fd(skel->maps.events);
@@ -141,19 +1425,91 @@ restart:
 	}
 
 	while (!exit_req && !UEI_EXITED(skel, uei)) {
-		__u64 enq_hi, enq_lo, demote;
+		__u64 st[STAT_NR];
 
 		/* Drain events so DEMOTE/DONE_LO print quickly */
 		if (rb)
 			ring_buffer__poll(rb, 0);
 
-		read_needed_stats(skel, &enq_hi, &enq_lo, &demote);
-		printf("enq_hi=%llu enq_lo=%llu demote=%llu\n",
-		       (unsigned long long)enq_hi,
-		       (unsigned long long)enq_lo,
-		       (unsigned long long)demote);
+		read_stats(skel, st);
+		ev_dropped = ev_dropped_base + st[STAT_EV_DROP];
+
+		/* how the first second after (re)attach went for HI tasks */
+		if (!settle_reported && skel->rodata->enable_stats &&
+		    mono_now_s() - attached_s >= 1.0) {
+			__u64 waits = st[STAT_HI_WAITS] - st_load[STAT_HI_WAITS];
+
+			printf("state: first 1s: restored=%llu enq_hi=%llu hi_wait_avg=%.1fus\n",
+			       (unsigned long long)(st[STAT_RESTORED] - st_load[STAT_RESTORED]),
+			       (unsigned long long)(st[STAT_ENQ_HI] - st_load[STAT_ENQ_HI]),
+			       waits ? (st[STAT_HI_WAIT_NS] - st_load[STAT_HI_WAIT_NS]) / 1e3 / waits : 0.0);
+			settle_reported = true;
+		}
+		if (skel->rodata->enable_stats)
+			printf("enq_hi=%llu enq_lo=%llu demote=%llu dispatch=%llu useful=%llu "
+			       "mig_core=%llu mig_llc=%llu mig_xllc=%llu sticky=%llu sticky_miss=%llu "
+			       "inherit=%llu inherit_lo=%llu admit_reject=%llu pinned=%llu "
+			       "ext=%llu ext_deny=%llu ext_ns=%llu ext_debt_ns=%llu "
+			       "wake_sync=%llu wake_llc=%llu\n",
+			       (unsigned long long)st[STAT_ENQ_HI],
+			       (unsigned long long)st[STAT_ENQ_LO],
+			       (unsigned long long)st[STAT_DEMOTE],
+			       (unsigned long long)st[STAT_DISPATCH],
+			       (unsigned long long)st[STAT_DISPATCH_USEFUL],
+			       (unsigned long long)st[STAT_MIG_SAME_CORE],
+			       (unsigned long long)st[STAT_MIG_SAME_LLC],
+			       (unsigned long long)st[STAT_MIG_CROSS_LLC],
+			       (unsigned long long)st[STAT_STICKY],
+			       (unsigned long long)st[STAT_STICKY_MISS],
+			       (unsigned long long)st[STAT_INHERIT],
+			       (unsigned long long)st[STAT_INHERIT_LO],
+			       (unsigned long long)st[STAT_ADMIT_REJECT],
+			       (unsigned long long)st[STAT_PINNED],
+			       (unsigned long long)st[STAT_EXT_GRANT],
+			       (unsigned long long)st[STAT_EXT_DENY],
+			       (unsigned long long)st[STAT_EXT_NS],
+			       (unsigned long long)st[STAT_EXT_DEBT_NS],
+			       (unsigned long long)st[STAT_WAKE_SYNC],
+			       (unsigned long long)st[STAT_WAKE_LLC]);
+		if (us) {
+			__u64 done = st[STAT_USER_DISPATCH] + st[STAT_USER_FALLBACK];
+
+			printf("user[%s]: enq=%llu dispatched=%llu fallback=%llu (%.2f%%) "
+			       "stale=%llu full=%llu rtt_avg=%.1fus\n", user_policy->name,
+			       (unsigned long long)st[STAT_USER_ENQ],
+			       (unsigned long long)st[STAT_USER_DISPATCH],
+			       (unsigned long long)st[STAT_USER_FALLBACK],
+			       done ? 100.0 * st[STAT_USER_FALLBACK] / done : 0.0,
+			       (unsigned long long)st[STAT_USER_STALE],
+			       (unsigned long long)st[STAT_USER_FULL],
+			       st[STAT_USER_DISPATCH] ?
+			       st[STAT_USER_RTT_NS] / 1e3 / st[STAT_USER_DISPATCH] : 0.0);
+		}
+		if (skel->rodata->partition_mode && skel->rodata->enable_stats)
+			partition_adjust(skel, st);
 		fflush(stdout);
 
+#ifdef MLFQ_PROFILE
+		sched_prof_poll(&prof, PROF_REPORT_MS);
+#endif
+
+		if (show_agg && mono_now_s() - agg_report_last >= AGG_REPORT_MS / 1e3) {
+			report_agg(skel);
+			agg_report_last = mono_now_s();
+		}
+
+#ifdef MLFQ_ARENA
+		if (mono_now_s() - arena_report_last >= ARENA_REPORT_MS / 1e3) {
+			report_arena(skel);
+			arena_report_last = mono_now_s();
+		}
+#endif
+
+		if (msrv) {
+			render_metrics(skel, st, &mb);
+			metrics_server_publish(msrv, &mb);
+		}
+
 		usleep((useconds_t)PRINT_INTERVAL_MS * 1000);
 	}
 
@@ -164,12 +1520,30 @@ restart:
 	if (rb)
 		ring_buffer__free(rb);
 
+	if (dump_migrations)
+		print_task_migrations(skel);
+
+#ifdef MLFQ_ARENA
+	if (dump_arena)
+		print_arena_tasks(skel);
+#endif
+
+	if (nr_rules)
+		print_rule_hits(skel);
+
+	user_sched_stop(us);
+	us = NULL;
+
 	bpf_link__destroy(link);
+	detach_s = mono_now_s();
 	ecode = UEI_REPORT(skel, uei);
 	scx_mlfq__destroy(skel);
 
 	if (UEI_ECODE_RESTART(ecode))
 		goto restart;
 
+	trace_close(ev_dropped);
+	metrics_server_stop(msrv);
+	metrics_buf_free(&mb);
 	return 0;
 }
@@ -0,0 +1,240 @@
+/* scx_mlfq.h - definitions shared by scx_mlfq.bpf.c and the scx_mlfq loader */
+#ifndef __SCX_MLFQ_H
+#define __SCX_MLFQ_H
+
+/* Upper bound on CPUs the topology tables cover */
+#define MLFQ_MAX_CPUS 512
+
+/* HI and LO */
+#define MLFQ_NR_LEVELS 2
+
+/* Upper bound on dispatch_batch, keeps the dispatch loop verifier-friendly */
+#define MLFQ_MAX_DISPATCH_BATCH 32
+
+/* Stats map indices */
+enum mlfq_stat {
+	STAT_ENQ_HI = 0,
+	STAT_ENQ_LO = 1,
+	STAT_CONS_HI = 2,		/* tasks moved from DSQ_HI to a local DSQ */
+	STAT_CONS_LO = 3,		/* tasks moved from DSQ_LO to a local DSQ */
+	STAT_DEMOTE = 4,
+	STAT_MIG_SAME_CORE = 5,		/* moved to an SMT sibling */
+	STAT_MIG_SAME_LLC = 6,		/* moved to another core sharing the LLC */
+	STAT_MIG_CROSS_LLC = 7,		/* moved across LLCs */
+	STAT_STICKY = 8,		/* LO task queued back on its cache-hot CPU */
+	STAT_STICKY_MISS = 9,		/* cache-hot, but previous CPU stayed busy */
+	STAT_EV_DROP = 10,		/* trace events lost to backlog or a full ringbuf */
+	STAT_DISPATCH = 11,		/* mlfq_dispatch invocations */
+	STAT_DISPATCH_USEFUL = 12,	/* ... that moved at least one task */
+	STAT_USER_ENQ = 13,		/* tasks handed to the userspace policy */
+	STAT_USER_DISPATCH = 14,	/* ... dispatched on the policy's decision */
+	STAT_USER_FALLBACK = 15,	/* ... dispatched by BPF after user_timeout_ns */
+	STAT_USER_STALE = 16,		/* decisions for tasks no longer pending */
+	STAT_USER_FULL = 17,		/* enqueues that could not be handed off */
+	STAT_USER_RTT_NS = 18,		/* summed enqueue-to-decision latency */
+	STAT_INHERIT = 19,		/* new tasks whose level came from a tracked parent */
+	STAT_INHERIT_LO = 20,		/* ... that started in LO (parent LO or CPU-busy) */
+	STAT_ADMIT_REJECT = 21,		/* fresh children kept out of HI by the rate limit */
+	STAT_PINNED = 22,		/* single-CPU tasks queued on their CPU's own DSQ */
+	STAT_CONS_PCPU = 23,		/* tasks moved from a per-CPU DSQ to the local DSQ */
+	STAT_HI_WAITS = 24,		/* HI tasks that went from enqueue to running */
+	STAT_HI_WAIT_NS = 25,		/* ... summed enqueue-to-running time */
+	STAT_BUSY_INTERACTIVE_NS = 26,	/* run time on interactive CPUs (partition mode) */
+	STAT_BUSY_BATCH_NS = 27,	/* run time on batch CPUs (partition mode) */
+	STAT_EXT_GRANT = 28,		/* HI slices extended for a task in a critical section */
+	STAT_EXT_DENY = 29,		/* ... refused: already extended this slice */
+	STAT_EXT_NS = 30,		/* extension time actually used */
+	STAT_WAKE_SYNC = 31,		/* sync wakeups run next on the waker's CPU */
+	STAT_WAKE_LLC = 32,		/* affine wakeups placed on an idle CPU in the waker's LLC */
+	STAT_WAKE_FLIPPY = 33,		/* affinity skipped: waker changes too often */
+	STAT_RESTORED = 34,		/* tasks that kept their state across a reload */
+	STAT_RULE_MATCH = 35,		/* new tasks classified by a rule (see rule_hits) */
+	STAT_CTX_MISS = 36,		/* task_level lookups that missed (LRU eviction) */
+	STAT_EXT_DEBT_NS = 37,		/* extension time taken off later HI slices */
+	STAT_NR,
+};
+
+/* Migration kinds, in order of increasing cost */
+enum mlfq_mig {
+	MIG_SAME_CORE = 0,
+	MIG_SAME_LLC = 1,
+	MIG_CROSS_LLC = 2,
+	MIG_NR,
+};
+
+/* Per-task scheduler state, value of the task_level map (keyed by pid) */
+struct task_ctx {
+	__u8  level;			/* 0 => HI, 1 => LO */
+	__u8  user_pending;		/* waiting for a userspace policy decision */
+	__u8  slice_ext;		/* current slice was extended (lock holder) */
+	__u8  _pad;
+	__s32 last_cpu;			/* -1 until the task has run once */
+	__u64 last_ran_ns;		/* when the task last stopped running */
+	__u64 run_start_ns;		/* when the current/last run started */
+	__u64 last_burst_ns;		/* length of the last run */
+	__u32 user_seq;			/* bumped on every hand-off to userspace */
+	__u32 rec_slot;			/* arena record index + 1, 0 if none */
+	__u64 nr_migrations[MIG_NR];
+	__u64 recent_run_ns;		/* runtime, halved every usage_window_ns */
+	__u64 usage_stamp_ns;		/* last time recent_run_ns was decayed */
+	__u64 enq_ns;			/* last enqueue, 0 once the task is running */
+	__u64 ext_debt_ns;		/* extension time taken off the next HI slice */
+	__u32 waker_pid;		/* majority-vote guess of the usual waker */
+	__u8  waker_votes;		/* ... its vote count, saturating */
+	__u8  waker_flips;		/* recent wakeups by someone else */
+	__u8  wakeups;			/* recent wakeups, window for waker_flips */
+	__u8  demote;			/* enum rule_demote, from the matching rule */
+	__u16 rule_id;			/* matching rule index + 1, 0 if none */
+	__u64 agg_wait_ns;		/* queue wait not yet added to the aggregates */
+	__u64 start_ns;			/* task start_time, tells a restored pid from a reused one */
+	__u64 hi_slice_ns;		/* HI slice from the matching rule, 0: HI_SLICE_NS */
+};
+
+/*
+ * Classification rules (scx_mlfq -r file), matched in mlfq_enable and again
+ * at exec (mlfq_exec), when a forked child takes its own comm.
+ * A task can match by cgroup id (rule_cgroup hash), comm prefix (rule_comm
+ * LPM trie) or parent comm prefix (rule_pcomm LPM trie); every map yields a
+ * rule index and the lowest index, i.e. the earliest rule in the file, wins.
+ * A trie returns its longest matching key, so the loader stores under each
+ * key the earliest rule among the keys that prefix it (rule_comm_index()).
+ */
+#define MLFQ_MAX_RULES		256
+#define MLFQ_RULE_LEVEL_KEEP	0xff	/* leave the level to inheritance/admission */
+
+enum rule_demote {
+	RULE_DEMOTE_DEFAULT = 0,	/* one HI slice, then LO */
+	RULE_DEMOTE_NEVER = 1,		/* stays in HI whatever it runs */
+};
+
+struct mlfq_rule {
+	__u64 slice_ns;			/* HI slice override, 0: default */
+	__u8  level;			/* 0, 1 or MLFQ_RULE_LEVEL_KEEP */
+	__u8  demote;			/* enum rule_demote */
+	__u8  _pad[6];
+};
+
+struct rule_comm_key {
+	__u32 prefixlen;		/* in bits */
+	char  comm[16];
+};
+
+/*
+ * Maps kept pinned under MLFQ_STATE_DIR across restarts and redeploys (see
+ * state_pin.h). Bump MLFQ_STATE_VERSION when a pinned value changes meaning
+ * without changing size; size changes are caught on their own.
+ */
+#define MLFQ_STATE_DIR		"/sys/fs/bpf/scx_mlfq"
+#define MLFQ_STATE_VERSION	1
+
+/*
+ * User-space-assisted mode (scx_mlfq -u): mlfq_enqueue hands runnable tasks
+ * to the loader's policy thread as struct user_task records, and the policy
+ * answers with struct user_decision records in the order tasks should run.
+ */
+#define MLFQ_USER_QUEUE_LEN	8192	/* max tasks awaiting a decision */
+#define MLFQ_USER_DRAIN_BATCH	8	/* decisions applied per dispatch call */
+
+struct user_task {
+	__u64 enq_ns;
+	__u64 last_burst_ns;
+	__u32 pid;
+	__u32 seq;
+	__u8  level;
+	__u8  _pad[7];
+};
+
+struct user_decision {
+	__u64 enq_ns;			/* echoed from user_task, for latency */
+	__u64 slice_ns;			/* 0: the level's default slice */
+	__u32 pid;
+	__u32 seq;			/* echoed from user_task */
+};
+
+/*
+ * Shared per-task table (MLFQ_ARENA builds): a slab of task_rec in a BPF
+ * arena that the loader mmaps and reads without syscalls. BPF makes gen odd
+ * before touching a record and even again afterwards; a reader that sees
+ * the same even gen before and after copying a record has a consistent copy.
+ */
+#define MLFQ_ARENA_SLOTS	(1 << 17)
+
+struct task_rec {
+	__u32 gen;
+	__u32 pid;			/* 0: slot free */
+	__u8  level;
+	__u8  _pad[3];
+	__s32 last_cpu;
+	__u64 runtime_ns;
+	__u64 wait_ns;
+	__u64 nr_switches;
+};
+
+/*
+ * Per-application aggregates (scx_mlfq -g): LRU per-CPU hashes keyed by
+ * tgid (tgid_stats) and by comm (comm_stats). Each CPU adds to its own copy;
+ * readers sum the copies, so reading cost follows the number of
+ * applications, not threads.
+ */
+#define MLFQ_AGG_ENTRIES	4096
+
+struct agg_stats {
+	__u64 runtime_ns;
+	__u64 wait_ns;			/* enqueue to running */
+	__u64 nr_switches;
+	__u64 nr_demotions;
+};
+
+struct comm_key {
+	char comm[16];			/* TASK_COMM_LEN, NUL padded */
+};
+
+/*
+ * Lock-holder hints. A thread registered through mlfq_hint.h owns one
+ * slice_hint in the pinned, mmapable slice_hints array and keeps in_cs
+ * non-zero while it is inside a critical section. Its slot is one of the
+ * MLFQ_HINT_PROBE slots from tid % MLFQ_HINT_SLOTS on, so BPF finds it with
+ * no help from the client. A HI task whose slice runs out with in_cs set
+ * gets one bounded extension, charged against its next HI slice.
+ */
+#define MLFQ_HINT_SLOTS		4096
+#define MLFQ_HINT_PROBE		8
+#define MLFQ_HINT_PIN_DIR	"/sys/fs/bpf"
+#define MLFQ_HINT_MAP		"slice_hints"
+
+struct slice_hint {
+	__u32 tid;			/* owner, 0 if the slot is free */
+	__u32 in_cs;			/* critical section nesting depth */
+};
+
+/* Ringbuf events. DEMOTE/DONE_LO are always on; the rest need trace_all. */
+enum ev_type {
+	EV_DEMOTE   = 1,
+	EV_DONE_LO  = 2,
+	EV_ENQUEUE  = 3,
+	EV_RUNNING  = 4,
+	EV_STOPPING = 5,
+};
+
+struct ev {
+	__u64 ts_ns;
+	__u32 cpu;
+	__u32 pid;
+	__u8  type;
+	__u8  level;
+	__u8  runnable;			/* EV_STOPPING only */
+	__u8  _pad;
+};					/* 24 bytes with tail padding */
+
+/* Header of the binary trace file written by scx_mlfq -T */
+#define MLFQ_TRACE_MAGIC "MLFQTRC1"
+
+struct mlfq_trace_hdr {
+	char  magic[8];
+	__u32 ev_size;			/* sizeof(struct ev) */
+	__u32 sample_shift;		/* 1 in 2^shift pids recorded */
+	__u64 nr_events;		/* records following the header */
+	__u64 nr_dropped;		/* STAT_EV_DROP at the end of the run */
+};
+
+#endif /* __SCX_MLFQ_H */
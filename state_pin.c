@@ -0,0 +1,178 @@
+/*
+ * state_pin.c - keep scheduler maps in bpffs across restarts and redeploys
+ *
+ * libbpf can pin by name on its own, but it cannot tell a map whose value
+ * layout changed between builds from one that did not; a stale task_ctx
+ * read with the new layout is worse than starting over. The meta map
+ * carries a caller-chosen layout version, and every map is also checked
+ * for type, key/value size and max_entries before bpf_map__reuse_fd().
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "state_pin.h"
+
+#define STATE_MAGIC 0x53435853	/* "SCXS" */
+
+static void pin_path(char *buf, size_t len, const char *dir, const char *name)
+{
+	snprintf(buf, len, "%s/%s", dir, name);
+}
+
+static void remove_pins(const char *dir, const char *const names[])
+{
+	char path[256];
+	int i;
+
+	for (i = 0; names[i]; i++) {
+		pin_path(path, sizeof(path), dir, names[i]);
+		unlink(path);
+	}
+	pin_path(path, sizeof(path), dir, "meta");
+	unlink(path);
+}
+
+static int read_meta(const char *dir, struct state_meta *meta)
+{
+	char path[256];
+	__u32 key = 0;
+	int fd, ret;
+
+	pin_path(path, sizeof(path), dir, "meta");
+	fd = bpf_obj_get(path);
+	if (fd < 0)
+		return -errno;
+	ret = bpf_map_lookup_elem(fd, &key, meta);
+	close(fd);
+	return ret ? -errno : 0;
+}
+
+/* Pinned map at @path if it has the shape @map expects, else -1 */
+static int open_compat(struct bpf_map *map, const char *path)
+{
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+	int fd;
+
+	fd = bpf_obj_get(path);
+	if (fd < 0)
+		return -1;
+
+	if (bpf_map_get_info_by_fd(fd, &info, &len) ||
+	    info.type != bpf_map__type(map) ||
+	    info.key_size != bpf_map__key_size(map) ||
+	    info.value_size != bpf_map__value_size(map) ||
+	    info.max_entries != bpf_map__max_entries(map)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int state_pin_reuse(struct bpf_object *obj, const char *dir,
+		    const char *const names[], __u32 version, bool fresh)
+{
+	int fds[64], nr, i, reused = 0;
+	struct state_meta meta;
+	char path[256];
+
+	for (nr = 0; names[nr]; nr++)
+		;
+	if (nr > (int)(sizeof(fds) / sizeof(fds[0])))
+		return -E2BIG;
+
+	if (fresh || read_meta(dir, &meta) ||
+	    meta.magic != STATE_MAGIC || meta.version != version) {
+		remove_pins(dir, names);
+		return 0;
+	}
+
+	/* all or nothing: a half-restored state is not self-consistent */
+	for (i = 0; i < nr; i++) {
+		struct bpf_map *map = bpf_object__find_map_by_name(obj, names[i]);
+
+		pin_path(path, sizeof(path), dir, names[i]);
+		fds[i] = map ? open_compat(map, path) : -1;
+		if (fds[i] < 0) {
+			fprintf(stderr, "state: %s does not match, starting fresh\n", path);
+			while (i--)
+				close(fds[i]);
+			remove_pins(dir, names);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct bpf_map *map = bpf_object__find_map_by_name(obj, names[i]);
+
+		if (!bpf_map__reuse_fd(map, fds[i]))
+			reused++;
+		close(fds[i]);
+	}
+	return reused;
+}
+
+int state_pin_save(struct bpf_object *obj, const char *dir,
+		   const char *const names[], __u32 version, struct state_meta *out)
+{
+	struct state_meta meta = {};
+	char path[256];
+	__u32 key = 0;
+	int i, fd, ret;
+
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		ret = -errno;
+		fprintf(stderr, "state: cannot create %s: %s\n", dir, strerror(errno));
+		return ret;
+	}
+
+	for (i = 0; names[i]; i++) {
+		struct bpf_map *map = bpf_object__find_map_by_name(obj, names[i]);
+
+		pin_path(path, sizeof(path), dir, names[i]);
+		if (!map || !access(path, F_OK))
+			continue;	/* reused maps are already pinned */
+		ret = bpf_map__pin(map, path);
+		if (ret) {
+			fprintf(stderr, "state: cannot pin %s: %s\n", path, strerror(-ret));
+			return ret;
+		}
+	}
+
+	pin_path(path, sizeof(path), dir, "meta");
+	fd = bpf_obj_get(path);
+	if (fd < 0) {
+		fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "state_meta", sizeof(key),
+				    sizeof(meta), 1, NULL);
+		if (fd < 0 || bpf_obj_pin(fd, path)) {
+			ret = -errno;
+			fprintf(stderr, "state: cannot pin %s: %s\n", path, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			return ret;
+		}
+	} else if (bpf_map_lookup_elem(fd, &key, &meta)) {
+		memset(&meta, 0, sizeof(meta));
+	}
+
+	if (meta.magic != STATE_MAGIC || meta.version != version) {
+		memset(&meta, 0, sizeof(meta));
+		meta.magic = STATE_MAGIC;
+		meta.version = version;
+		meta.created_s = time(NULL);
+	}
+	meta.loads++;
+
+	ret = bpf_map_update_elem(fd, &key, &meta, BPF_ANY) ? -errno : 0;
+	close(fd);
+	if (out)
+		*out = meta;
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* state_pin.h - keep scheduler maps in bpffs across restarts and redeploys */
+#ifndef __STATE_PIN_H
+#define __STATE_PIN_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+struct bpf_object;
+
+/*
+ * Maps listed in @names are pinned as <dir>/<name>, next to a one-entry
+ * <dir>/meta map holding a struct state_meta. @version identifies the
+ * layout of the pinned values; callers fold in every size that matters.
+ */
+struct state_meta {
+	__u32 magic;
+	__u32 version;
+	__u64 loads;			/* loads that used this state, including the first */
+	__u64 created_s;		/* CLOCK_REALTIME when the state was created */
+};
+
+/*
+ * Call between open and load. Points the maps at their pinned copies if
+ * the meta matches @version and every pinned map has the layout the object
+ * expects; otherwise, or with @fresh, removes the old pins so the load
+ * starts from empty maps. Returns the number of maps reused.
+ */
+int state_pin_reuse(struct bpf_object *obj, const char *dir,
+		    const char *const names[], __u32 version, bool fresh);
+
+/*
+ * Call after load. Pins the maps that were not reused and records the load
+ * in the meta map. Returns the updated meta in @meta (may be NULL); failures
+ * are reported and leave the scheduler running without persistence.
+ */
+int state_pin_save(struct bpf_object *obj, const char *dir,
+		   const char *const names[], __u32 version, struct state_meta *meta);
+
+#endif /* __STATE_PIN_H */
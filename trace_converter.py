@@ -0,0 +1,151 @@
+import argparse
+import json
+import struct
+import sys
+
+# must match struct mlfq_trace_hdr / struct ev in scx_mlfq.h
+HDR_FMT = "<8sIIQQ"
+EV_FMT = "<QIIBBBB4x"  # struct ev is padded to 24 bytes
+MAGIC = b"MLFQTRC1"
+
+EV_DEMOTE = 1
+EV_DONE_LO = 2
+EV_ENQUEUE = 3
+EV_RUNNING = 4
+EV_STOPPING = 5
+
+LEVEL_NAMES = {0: "HI", 1: "LO"}
+
+# chrome trace "processes" used to group the tracks
+CPU_TRACKS = 0
+QUEUE_TRACKS = 1
+
+
+def read_trace(path):
+
+    with open(path, "rb") as f:
+        raw = f.read()
+
+    hdr_size = struct.calcsize(HDR_FMT)
+    magic, ev_size, sample_shift, nr_events, nr_dropped = \
+        struct.unpack_from(HDR_FMT, raw, 0)
+
+    if magic != MAGIC:
+        sys.exit(f"{path}: not an scx_mlfq trace")
+    if ev_size != struct.calcsize(EV_FMT):
+        sys.exit(f"{path}: event size {ev_size} does not match this converter")
+
+    events = []
+    for off in range(hdr_size, len(raw) - ev_size + 1, ev_size):
+        ts, cpu, pid, typ, level, runnable, _ = struct.unpack_from(EV_FMT, raw, off)
+        events.append((ts, cpu, pid, typ, level, runnable))
+
+    # per-cpu ringbuf producers are not globally ordered
+    events.sort(key=lambda e: e[0])
+
+    info = {
+        "nr_events": nr_events,
+        "nr_dropped": nr_dropped,
+        "sample_shift": sample_shift,
+    }
+    return events, info
+
+
+def to_chrome(events, info):
+
+    out = []
+    if not events:
+        return {"traceEvents": out, "otherData": info}
+
+    t0 = events[0][0]
+
+    def us(ts):
+        return (ts - t0) / 1000.0
+
+    cpus = sorted({e[1] for e in events})
+
+    out.append({"ph": "M", "name": "process_name", "pid": CPU_TRACKS,
+                "args": {"name": "CPUs"}})
+    out.append({"ph": "M", "name": "process_name", "pid": QUEUE_TRACKS,
+                "args": {"name": "Enqueues"}})
+    for cpu in cpus:
+        for proc in (CPU_TRACKS, QUEUE_TRACKS):
+            out.append({"ph": "M", "name": "thread_name", "pid": proc,
+                        "tid": cpu, "args": {"name": f"CPU {cpu}"}})
+
+    running = {}     # cpu -> (start_ts, pid, level, flow_id, enq_ts)
+    pending = {}     # pid -> (flow_id, enq_ts) of the last unserved enqueue
+    next_flow = 1
+    unmatched_stops = 0
+
+    def close_slice(cpu, end_ts, runnable):
+        start, pid, level, flow_id, enq_ts = running.pop(cpu)
+        ev = {
+            "ph": "X", "name": f"pid {pid}", "cat": LEVEL_NAMES.get(level, str(level)),
+            "pid": CPU_TRACKS, "tid": cpu,
+            "ts": us(start), "dur": max(us(end_ts) - us(start), 0.001),
+            "args": {"pid": pid, "level": level, "runnable": bool(runnable)},
+        }
+        if flow_id is not None:
+            ev["bind_id"] = flow_id
+            ev["flow_in"] = True
+            ev["args"]["queue_us"] = (start - enq_ts) / 1000.0
+        out.append(ev)
+
+    for ts, cpu, pid, typ, level, runnable in events:
+        if typ == EV_ENQUEUE:
+            flow_id = next_flow
+            next_flow += 1
+            pending[pid] = (flow_id, ts)
+            out.append({
+                "ph": "X", "name": f"enqueue pid {pid}", "cat": "enqueue",
+                "pid": QUEUE_TRACKS, "tid": cpu, "ts": us(ts), "dur": 0.001,
+                "bind_id": flow_id, "flow_out": True,
+                "args": {"pid": pid, "level": level},
+            })
+        elif typ == EV_RUNNING:
+            # a missed stopping event (drop) leaves a slice open; end it here
+            if cpu in running:
+                close_slice(cpu, ts, True)
+            flow_id, enq_ts = pending.pop(pid, (None, None))
+            running[cpu] = (ts, pid, level, flow_id, enq_ts)
+        elif typ == EV_STOPPING:
+            if cpu in running and running[cpu][1] == pid:
+                close_slice(cpu, ts, runnable)
+            else:
+                unmatched_stops += 1
+        elif typ in (EV_DEMOTE, EV_DONE_LO):
+            name = "demote" if typ == EV_DEMOTE else "done in LO"
+            out.append({
+                "ph": "i", "s": "t", "name": f"{name} pid {pid}", "cat": name,
+                "pid": CPU_TRACKS, "tid": cpu, "ts": us(ts),
+                "args": {"pid": pid},
+            })
+
+    last_ts = events[-1][0]
+    for cpu in list(running):
+        close_slice(cpu, last_ts, True)
+
+    info = dict(info, unmatched_stops=unmatched_stops)
+    return {"traceEvents": out, "displayTimeUnit": "ns", "otherData": info}
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Convert an scx_mlfq -T trace into Chrome trace JSON (opens in ui.perfetto.dev)")
+    parser.add_argument("trace", help="binary trace written by scx_mlfq -T")
+    parser.add_argument("-o", "--output", default="mlfq_trace.json", help="output JSON file")
+
+    args = parser.parse_args()
+
+    events, info = read_trace(args.trace)
+    trace = to_chrome(events, info)
+
+    with open(args.output, "w") as f:
+        json.dump(trace, f)
+
+    lost = info["nr_dropped"]
+    total = info["nr_events"] + lost
+    print(f"{len(events)} events, {lost} dropped ({100.0 * lost / total if total else 0:.2f}%), "
+          f"1 in {1 << info['sample_shift']} pids sampled")
+    print(f"Trace saved to {args.output}")